@@ -18,9 +18,8 @@ unsigned char joy_y = 100;
 
 unsigned int base_addr;
 
-// mega65r3 QSPI has the most space currently with 8x8MB
-// this is to much for r3 or r2, but we can handle...
-#define MAX_SLOTS 8
+// slots shown on one screen of the menu, 3 rows each
+#define MENU_SLOTS 8
 
 // core flags/caps
 #define CORECAP_USED 0b10000111
@@ -88,6 +87,24 @@ unsigned char check_cartridge(void) {
 unsigned char scan_bitstream_information(unsigned char search_flags,
                                          unsigned char update_slot);
 
+/*
+ * uchar find_boot_slot(search_flags)
+ *
+ * returns the first slot with one of search_flags, else the first
+ * default slot, else 0xff
+ */
+unsigned char find_boot_slot(unsigned char search_flags) {
+  unsigned char slot, default_slot = 0xff;
+
+  for (slot = 0; slot < slot_count; slot++) {
+    if (slot_core[slot].flags & search_flags)
+      return slot;
+    if (default_slot == 0xff && slot_core[slot].flags & CORECAP_SLOT_DEFAULT)
+      default_slot = slot;
+  }
+  return default_slot;
+}
+
 void display_version(void) {
   unsigned char key;
   uint8_t core_hash_1 = PEEK(0xD632);
@@ -115,8 +132,10 @@ void display_version(void) {
 
 #ifndef STANDALONE
   // if this is the core megaflash, display boot slot selection information
+  // the menu scans all slots on start and after every reflash, so slot_core
+  // is what a boot would find
   search_cart = check_cartridge();
-  selected = scan_bitstream_information(search_cart, 0);
+  selected = find_boot_slot(search_cart);
   if (selected == 0xff)
     selected = 1 + ((PEEK(0xD69D) >> 3) & 1);
 
@@ -162,21 +181,6 @@ void display_version(void) {
   printf("%c%c", 0x93, 5);
 }
 
-unsigned char first_flash_read = 1;
-void do_first_flash_read(unsigned long addr) {
-  // XXX Work around weird flash thing where first read of a sector reads
-  // rubbish
-  read_data(addr);
-  for (short x = 0; x < 256; x++) {
-    if (data_buffer[0] != 0xee)
-      break;
-    usleep(50000L);
-    read_data(addr);
-    read_data(addr);
-  }
-  first_flash_read = 0;
-}
-
 /*
  * uchar scan_bitstream_information(search_flags, slot)
  *
@@ -186,7 +190,8 @@ void do_first_flash_read(unsigned long addr) {
  * if search_flags is not 0, then it is matched against the core flags
  * to determine the first slot that has one of the flags. The slot number
  * is returned. 0xff means not found. Searching for a slot will *not*
- * copy any slot information, to be fast!
+ * copy any slot information, to be fast! It stops at the first slot that
+ * has one of the flags, and does not tell empty from invalid slots.
  *
  * if slot is non zero, only the slot with the specified slot number & 0xf
  * is updated, otherwise all slots are updated (used after flash). Set high
@@ -196,14 +201,11 @@ void do_first_flash_read(unsigned long addr) {
 unsigned char scan_bitstream_information(unsigned char search_flags,
                                          unsigned char update_slot) {
   short slot, j;
-  unsigned char found = 0xff, default_slot = 0xff, flagmask = CORECAP_USED;
-
-  if (first_flash_read)
-    do_first_flash_read(0);
+  unsigned char flagmask = CORECAP_USED;
 
   for (slot = update_slot & 0x0f; slot < slot_count; slot++) {
-    // read first sector from flash slot
-    read_data(slot * SLOT_SIZE);
+    // read the header of the first sector from flash slot
+    read_data_to(slot * SLOT_SIZE, (unsigned long)data_buffer, 0x80);
 
     // check for bitstream magic
     slot_core[slot].valid = SLOT_VALID;
@@ -219,24 +221,19 @@ unsigned char scan_bitstream_information(unsigned char search_flags,
       slot_core[slot].flags = data_buffer[0x7c] & flagmask;
       // remove flags from flagmask (we only find the first flag of a kind)
       flagmask ^= slot_core[slot].flags;
-      if (search_flags && found == 0xff &&
-          (slot_core[slot].flags & search_flags))
-        found = slot;
-      if (default_slot == 0xff &&
-          (slot_core[slot].flags & CORECAP_SLOT_DEFAULT))
-        default_slot = slot;
     } else {
       slot_core[slot].capabilities = slot_core[slot].flags = 0;
-      // check if slot is empty (all FF)
-      for (j = 0; j < 512 && data_buffer[j] == 0xff; j++)
-        ;
-      if (j == 512)
+      // check if slot is empty (all FF), not needed to find a slot
+      if (!search_flags && flash_region_blank(slot * SLOT_SIZE, 512))
         slot_core[slot].valid = SLOT_EMPTY;
     }
 
     // if we are searching for a slot, we can cut the process short...
-    if (search_flags)
+    if (search_flags) {
+      if (slot_core[slot].flags & search_flags)
+        break;
       continue;
+    }
 
     lfill((long)slot_core[slot].name, ' ', 64);
     // extract names
@@ -263,7 +260,7 @@ unsigned char scan_bitstream_information(unsigned char search_flags,
       break;
   }
 
-  return found != 0xff ? found : default_slot;
+  return find_boot_slot(search_flags);
 }
 
 void write_text(unsigned char x, unsigned char y, char *text, uint8_t length) {
@@ -315,25 +312,56 @@ unsigned char confirm_slot0_flash() {
 }
 
 #include <cbm_screen_charmap.h>
-void display_cartridge(short slot) {
-  unsigned char offset = 1;
+void display_cartridge(short slot, unsigned char row) {
+  unsigned char offset = row * 3 + 1;
   // TODO: if we get more than 3 cartridge types, we need to change this!
 
   // if all three bits are 1, write ALL... is that even possible?
   if ((slot_core[slot].flags & CORECAP_CART) == CORECAP_CART) {
-    write_text(35, slot * 3 + offset, "[ALL]", 5);
+    write_text(35, offset, "[ALL]", 5);
     return;
   }
 
   if (slot_core[slot].flags & CORECAP_CART_C64)
-    write_text(35, slot * 3 + offset++, "[C64]", 5);
+    write_text(35, offset++, "[C64]", 5);
   if (slot_core[slot].flags & CORECAP_CART_C128)
-    write_text(35, slot * 3 + offset++, "[128]", 5);
+    write_text(35, offset++, "[128]", 5);
   if (slot_core[slot].flags & CORECAP_CART_M65)
-    write_text(35, slot * 3 + offset++, "[M65]", 5);
+    write_text(35, offset++, "[M65]", 5);
 }
 #include <cbm_petscii_charmap.h>
 
+/*
+ * uchar select_copy_slot(source)
+ *
+ * asks which slot the core in slot source should be copied to
+ *
+ * returns the slot, or 0xff if aborted
+ */
+unsigned char select_copy_slot(unsigned char source) {
+  unsigned char key;
+
+  printf("%c\nCopy the core in slot %X to which slot?\n"
+         "Press 1-%X, or any other key to abort.\n",
+         0x93, source, slot_count - 1);
+  while (PEEK(0xD610))
+    POKE(0xD610, 0);
+  while (!(key = PEEK(0xD610)))
+    continue;
+  POKE(0xD610, 0);
+
+  // slots above 9 are entered as hex digits, A-F or a-f
+  if ((key | 0x20) >= 0x61 && (key | 0x20) <= 0x66)
+    key = (key | 0x20) - (0x61 - 10);
+  else if (key >= '0' && key <= '9')
+    key -= '0';
+  else
+    return 0xff;
+  if (key > 0 && key < slot_count && key != source)
+    return key;
+  return 0xff;
+}
+
 void error_flash(void) {
   POKE(0xD020, 2);
   POKE(0xD021, 2);
@@ -358,27 +386,17 @@ void hard_exit(void) {
 #endif
 }
 
-void main(void) {
-  unsigned char selected = 0xff, atticram_bad = 0,
-                search_cart = CORECAP_SLOT_DEFAULT;
-#if !defined(FIRMWARE_UPGRADE) || !defined(STANDALONE)
-  unsigned char i, selected_reflash_slot, selected_file;
-#endif
-
-  mega65_io_enable();
-
-  SEI(); // this is useless, as the next printf a few lines down will do CLI
-
-  // we want to read this first!
-  exrom_game = PEEK(0xD67EU);
-
-  // white text, blue screen, black border, clear screen
-  POKE(0x286, 1);
-  POKE(0xd020, 0);
-  POKE(0xd021, 6);
-  printf("%c", 0x93);
-
 #ifndef STANDALONE
+/*
+ * boot_stub(void)
+ *
+ * the non-interactive part of the core megaflash: starts the boot core,
+ * or returns to HYPPO, before anything is put on the screen. Only returns
+ * if the menu is wanted, or the boot slot is broken.
+ */
+void boot_stub(void) {
+  unsigned char selected, search_cart;
+
   /*
    * This part is the *Startup Process* of the core,
    * so we don't need this if we are in standalone mode.
@@ -446,6 +464,11 @@ void main(void) {
       if (selected == 0xff)
         selected = 1 + ((PEEK(0xD69D) >> 3) & 1);
 
+      // the search does not check for empty slots, only this one matters
+      if (slot_core[selected].valid == SLOT_INVALID &&
+          flash_region_blank(selected * SLOT_SIZE, 512))
+        slot_core[selected].valid = SLOT_EMPTY;
+
       if (slot_core[selected].valid == SLOT_VALID) {
         // Valid bitstream -- so start it
         reconfig_fpga(SLOT_SIZE * selected + 4096);
@@ -454,6 +477,7 @@ void main(void) {
         // Switch back to normal speed control before exiting
         hard_exit();
       } else {
+        menu_screen();
         printf("WARNING: Flash slot %d seems to be\n"
                "messed up.\n"
                "To avoid seeing this message every time,"
@@ -470,12 +494,32 @@ void main(void) {
         }
         while (PEEK(0xD610))
           POKE(0xD610, 0);
-
-        printf("%c", 0x93);
       }
     }
   }
+}
+#endif
+
+void main(void) {
+  unsigned char selected = 0xff, atticram_bad = 0;
+#if !defined(FIRMWARE_UPGRADE) || !defined(STANDALONE)
+  unsigned char i, selected_reflash_slot, selected_file, top = 0, keys;
+#endif
+
+  mega65_io_enable();
+
+  SEI(); // this is useless, as the next printf a few lines down will do CLI
 
+  // we want to read this first!
+  exrom_game = PEEK(0xD67EU);
+
+#ifndef STANDALONE
+  boot_stub();
+#endif
+
+  menu_screen();
+
+#ifndef STANDALONE
   // we need to probe the hardware now, as we are going into the menu
   if (probe_hardware_version())
     hard_exit();
@@ -565,25 +609,33 @@ void main(void) {
 
   // clear screen
   selected = 0;
+  // number keys launch slots 0-9, more are reached with the cursor keys
+  keys = slot_count > 10 ? 10 : slot_count;
   printf("%c", 0x93);
   while (1) {
+    // scroll the list if the selection left it
+    if (selected < top || selected >= top + MENU_SLOTS) {
+      top = selected < top ? selected : selected - MENU_SLOTS + 1;
+      printf("%c", 0x93);
+    }
+
     // home cursor
     printf("%c%c", 0x13, 0x05);
 
-    for (i = 0; i < slot_count; i++) {
+    for (i = top; i < slot_count && i < top + MENU_SLOTS; i++) {
       // Display slot information
-      printf("\n %c%c%c %s",
-             slot_core[i].flags & CORECAP_SLOT_DEFAULT ? '>' : '(', '0' + i,
+      printf("\n %c%X%c %s",
+             slot_core[i].flags & CORECAP_SLOT_DEFAULT ? '>' : '(', i,
              slot_core[i].flags & CORECAP_SLOT_DEFAULT ? '<' : ')',
              slot_core[i].name);
       if (i > 0 && slot_core[i].valid == SLOT_VALID) {
         printf("\n     %s\n", slot_core[i].version);
-        display_cartridge(i);
+        display_cartridge(i, i - top);
       } else
         printf("\n\n");
 
       // highlight slot
-      base_addr = 0x0400 + i * (3 * 40);
+      base_addr = 0x0400 + (i - top) * (3 * 40);
       if (i == selected) {
         // Highlight selected item
         for (short x = 0; x < (3 * 40); x++) {
@@ -601,10 +653,10 @@ void main(void) {
       }
     }
     // Draw footer line with instructions
-    for (; i < 8; i++)
+    for (i -= top; i < MENU_SLOTS; i++)
       printf("%c%c%c", 17, 17, 17);
-    printf("%c0-%u = Launch Core.  CTRL 1-%u = Edit Slo%c", 0x12,
-           slot_count - 1, slot_count - 1, 0x92);
+    printf("%c0-%u,RET = Launch. CTRL 1-%u,E = Edit Slo%c", 0x12, keys - 1,
+           keys > 8 ? 7 : keys - 1, 0x92);
     POKE(1024 + 999, 0x14 + 0x80); // the 't'
 
     short x = 0;
@@ -615,7 +667,7 @@ void main(void) {
     }
     POKE(0xd610, 0);
 
-    if (x >= '0' && x < slot_count + '0') {
+    if (x >= '0' && x < keys + '0') {
       if (x == '0') {
         reconfig_fpga(0);
       } else if (slot_core[x - '0'].valid != 0) // only boot slot if not empty
@@ -625,6 +677,7 @@ void main(void) {
     }
 
     selected_reflash_slot = 0xff;
+    copy_source_slot = 0xff;
 
     switch (x) {
     case 0x03: // RUN-STOP
@@ -675,6 +728,17 @@ void main(void) {
       printf("%c%c", 0x93, 5);
       break;
 #endif
+    case 0x43: // C
+    case 0x63: // c
+      // copy the selected core to another slot
+      if (slot_core[selected].valid == SLOT_VALID) {
+        selected_reflash_slot = select_copy_slot(selected);
+        if (selected_reflash_slot != 0xff)
+          copy_source_slot = selected;
+      } else
+        error_flash();
+      printf("%c", 0x93);
+      break;
     case 144: // CTRL-1
       if (y & 0x04)
         selected_reflash_slot = 1;
@@ -705,6 +769,12 @@ void main(void) {
       else
         display_version();
       break;
+    case 0x45: // E
+    case 0x65: // e
+      // edit the selected slot, the only way to reach slots above 7
+      if (selected)
+        selected_reflash_slot = selected;
+      break;
     }
 
     // extra security against slot 0 flashing
@@ -718,7 +788,9 @@ void main(void) {
         continue;
       }
       selected_file = SELECTED_FILE_INVALID;
-      if (selected_reflash_slot == 0) {
+      if (copy_source_slot != 0xff)
+        selected_file = SELECTED_FILE_COPY;
+      else if (selected_reflash_slot == 0) {
 #include <ascii_charmap.h>
         strncpy(disk_name_return, "UPGRADE0.COR", 32);
 #include <cbm_screen_charmap.h>
@@ -731,7 +803,9 @@ void main(void) {
       if (selected_file != SELECTED_FILE_INVALID) {
         reflash_slot(selected_reflash_slot, selected_file,
                      slot_core[0].version);
-        scan_bitstream_information(0, selected_reflash_slot | 0x80);
+        // flags are masked by the slots below, so a change in one slot
+        // can change the flags of all slots above it
+        scan_bitstream_information(0, 0);
       }
       printf("%c", 0x93);
     }
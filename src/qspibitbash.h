@@ -0,0 +1,20 @@
+#ifndef QSPIBITBASH_H
+#define QSPIBITBASH_H
+
+// shadow of the last value written to BITBASH_PORT, lives in zero page
+extern unsigned char __zp bash_bits;
+
+// shift one byte out on SO, MSB first
+__attribute__((leaf)) void bash_tx_byte(unsigned char b);
+
+// shift one byte in from SI, MSB first
+__attribute__((leaf)) unsigned char bash_rx_byte(void);
+
+// send a single byte command and read len bytes of its reply into buf
+__attribute__((leaf)) void bash_cmd_read(unsigned char cmd, unsigned char len,
+                                         unsigned char *buf);
+
+// read SR1 until none of the bits in mask are set, returns SR1
+__attribute__((leaf)) unsigned char bash_sr1_wait(unsigned char mask);
+
+#endif /* QSPIBITBASH_H */
@@ -0,0 +1,146 @@
+;;
+;; Bitbashed SPI primitives for the QSPI flash
+;;
+;; These replace the C loops in qspicommon.c that do a PEEK or POKE for
+;; every clock edge. All bytes are shifted MSB first in SPI mode 3 on the
+;; SO (DQ0) line, sampling SI (DQ1), exactly like the C versions.
+;;
+
+BITBASH_PORT  = $D6CC
+CLOCKCTL_PORT = $D6CD
+
+;; shadow of the last value written to BITBASH_PORT, in zero page
+;; starts with CS high and all lines released, like the C version did
+.global bash_bits
+.section .zp.data.bash_bits,"zaw",@progbits
+bash_bits:
+        .byte $ff
+
+.global bash_tx_byte
+.section .text.bash_tx_byte,"ax",@progbits
+bash_tx_byte:
+        ;; void bash_tx_byte(unsigned char b)
+        ;;
+        ;; b in A
+        sta __rc2
+tx_rc2:
+        ;; disable tri-state of the QSPIDB lines
+        lda bash_bits
+        ora #$1e
+        and #$7f
+        sta bash_bits
+        sta BITBASH_PORT
+        ldx #$02
+        ldy #$00
+        .rept 8
+        sty CLOCKCTL_PORT       ; clock low
+        lda #$07
+        asl __rc2
+        rol a                   ; $0e or $0f, data bit on SO
+        sta BITBASH_PORT
+        stx CLOCKCTL_PORT       ; clock high
+        .endr
+        rts
+
+.global bash_rx_byte
+.section .text.bash_rx_byte,"ax",@progbits
+bash_rx_byte:
+        ;; unsigned char bash_rx_byte(void)
+        ;;
+        ;; returns the byte in A
+        lda #$8f                ; tri-state SI
+        sta BITBASH_PORT
+rx_byte:
+        ldx #$02
+        ldy #$00
+        .rept 8
+        sty CLOCKCTL_PORT       ; clock low
+        lda BITBASH_PORT
+        lsr a
+        lsr a                   ; SI into carry
+        rol __rc3
+        stx CLOCKCTL_PORT       ; clock high
+        .endr
+        lda __rc3
+        rts
+
+;; CS high, clock high, then CS low to start a command
+.section .text.bash_select,"ax",@progbits
+bash_select:
+        lda bash_bits
+        ora #$4f
+        sta BITBASH_PORT
+        ldx #$02
+        stx CLOCKCTL_PORT
+        and #$bf
+        ora #$0e
+        sta bash_bits
+        sta BITBASH_PORT
+        rts
+
+;; CS high to end a command
+.section .text.bash_deselect,"ax",@progbits
+bash_deselect:
+        lda bash_bits
+        ora #$4f
+        sta bash_bits
+        sta BITBASH_PORT
+        rts
+
+.global bash_cmd_read
+.section .text.bash_cmd_read,"ax",@progbits
+bash_cmd_read:
+        ;; void bash_cmd_read(unsigned char cmd, unsigned char len,
+        ;;                    unsigned char *buf)
+        ;;
+        ;; sends the single byte command cmd and reads len bytes into buf
+        ;; cmd in A, len in X, buf in __rc2/__rc3
+        pha
+        stx __rc4
+        lda __rc2
+        sta __rc5
+        lda __rc3
+        sta __rc6
+        jsr bash_select
+        pla
+        sta __rc2
+        jsr tx_rc2
+        lda #$8f                ; tri-state SI
+        sta BITBASH_PORT
+        lda #$00
+        sta __rc7               ; offset into buf
+cmd_read_loop:
+        lda __rc4
+        beq cmd_read_done
+        jsr rx_byte
+        ldy __rc7
+        sta (__rc5),y
+        inc __rc7
+        dec __rc4
+        bra cmd_read_loop
+cmd_read_done:
+        jmp bash_deselect
+
+.global bash_sr1_wait
+.section .text.bash_sr1_wait,"ax",@progbits
+bash_sr1_wait:
+        ;; unsigned char bash_sr1_wait(unsigned char mask)
+        ;;
+        ;; reads SR1 continuously (the flash repeats it for as long as
+        ;; CS stays low) until none of the bits in mask are set
+        ;; mask in A, returns the last SR1 value in A
+        sta __rc4
+        jsr bash_select
+        lda #$05
+        sta __rc2
+        jsr tx_rc2
+        lda #$8f                ; tri-state SI
+        sta BITBASH_PORT
+sr1_wait_loop:
+        jsr rx_byte
+        sta __rc5
+        and __rc4
+        bne sr1_wait_loop
+        jsr bash_deselect
+        lda __rc5
+        rts
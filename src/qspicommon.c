@@ -9,6 +9,7 @@
 #include <6502.h>
 
 #include "crc32accl.h"
+#include "qspibitbash.h"
 #include "qspicommon.h"
 #include "qspireconfig.h"
 
@@ -18,6 +19,8 @@ struct m65_tm tm_now;
 uint8_t hw_model_id = 0;
 char *hw_model_name = "?unknown?";
 unsigned char slot_count = 0;
+// source slot for SELECTED_FILE_COPY
+unsigned char copy_source_slot = 0xff;
 
 #ifdef STANDALONE
 uint8_t SLOT_MB = 1;
@@ -40,12 +43,62 @@ unsigned int page_size = 0;
 unsigned char latency_code = 0xff;
 unsigned char reg_cr1 = 0x00;
 unsigned char reg_sr1 = 0x00;
+unsigned char reg_ppbl = 0x00;
+unsigned char reg_ppb = 0x00;
+// loop count to wait for a $D680 read or verify, see qspi_calibrate
+unsigned char qspi_read_wait = 180;
 
 unsigned char manufacturer;
 unsigned short device_id;
 static unsigned char cfi_data[512];
 unsigned short cfi_length = 0;
 unsigned char flash_sector_bits = 0;
+
+/*
+  Erase types
+
+  the erase commands the flash offers, smallest first, with their typical
+  erase time. Filled in by probe_qspi_flash.
+*/
+typedef struct {
+  unsigned char size_bits;
+  unsigned char opcode;
+  unsigned short time_ms;
+} erase_type_type;
+
+#define ERASE_TYPE_MAX 4
+erase_type_type erase_types[ERASE_TYPE_MAX];
+unsigned char erase_type_count = 0;
+
+// 2^n bytes of flash, 2^n us to program a page
+unsigned char flash_size_bits = 0;
+unsigned char page_time_bits = 0;
+// address bytes of erase commands, 4 unless SFDP says otherwise
+unsigned char flash_addr_bytes = 4;
+// only Spansion parts are written to, the others are just detected
+unsigned char flash_read_only = 0;
+
+/*
+  Flash vendors
+
+  manufacturer ID from RDID, how to treat the part, and the name.
+*/
+// Spansion CFI layout, CR1 at 0x35, per sector DYB protection, quad enable
+// via WRR, and the opcodes the $D680 engine uses
+#define FLASH_VENDOR_CFI 0x01
+
+// clang-format off
+flash_vendor_type flash_vendors[] = {
+  { 0x01, FLASH_VENDOR_CFI, "Spansion" },
+  { 0xef, 0, "Winbond" },
+  { 0xc2, 0, "Macronix" },
+  { 0x9d, 0, "ISSI" },
+  { 0x20, 0, "Micron" },
+  { 0x00, 0, "unknown" }
+};
+// clang-format on
+
+flash_vendor_type *flash_vendor = flash_vendors;
 unsigned char last_sector_num = 0xff;
 unsigned char sector_num = 0xff;
 
@@ -205,6 +258,32 @@ unsigned char check_input(char *m, uint8_t case_sensitive) {
   return 1;
 }
 
+void menu_screen(void) {
+  // white text, blue screen, black border, clear screen
+  POKE(0x286, 1);
+  POKE(0xd020, 0);
+  POKE(0xd021, 6);
+  printf("%c", 0x93);
+}
+
+#ifndef STANDALONE
+unsigned char probe_screen_ready = 0;
+#endif
+
+/*
+ * probe_screen(void)
+ *
+ * the core megaflash probes the flash before it sets up the screen, so
+ * set it up once before the probe prints anything
+ */
+void probe_screen(void) {
+#ifndef STANDALONE
+  if (!probe_screen_ready)
+    menu_screen();
+  probe_screen_ready = 1;
+#endif
+}
+
 void wait_10ms(void) {
   // 16 x ~64usec raster lines = ~1ms
   int c = 160;
@@ -667,7 +746,7 @@ short display_offset = 0;
 
 #include <cbm_screen_charmap.h>
 char *diskchooser_instructions = " Select file for slot X, press <RETURN> "
-                                 " to accept or press <RUN/STOP> to abort ";
+                                 " to flash, V to verify, RUN/STOP abort  ";
 #include <cbm_petscii_charmap.h>
 #define erase_message "- Erase Slot -"
 
@@ -755,12 +834,13 @@ void draw_file_list(void) {
  *   0 - nothing was selected, abort
  *   1 - special erase entry was selected
  *   2 - file was selected, filename in disk_name_return
+ *   4 - file was selected for verify, filename in disk_name_return
  *
  * side-effects:
  *  disk_name_return may be changed
  */
 unsigned char select_bitstream_file(unsigned char slot) {
-  unsigned char x;
+  unsigned char x, verify;
   signed char fnlen, j;
   struct m65_dirent *dirent;
   int idle_time = 0;
@@ -815,7 +895,10 @@ unsigned char select_bitstream_file(unsigned char slot) {
   hy_closedir();
 
   // Okay, we have some disk images, now get the user to pick one!
-  diskchooser_instructions[22] = 0x30 + slot;
+  // slots above 9 are shown in hex, like in the menu
+#include <cbm_screen_charmap.h>
+  diskchooser_instructions[22] = "0123456789ABCDEF"[slot];
+#include <cbm_petscii_charmap.h>
   // Draw instructions to FOOTER
   lcopy((long)diskchooser_instructions, SCREEN_ADDRESS + 23 * 40, 80);
   lfill(COLOUR_RAM_ADDRESS + 23 * 40, HIGHLIGHT_ATTR, 80);
@@ -838,10 +921,18 @@ unsigned char select_bitstream_file(unsigned char slot) {
     } else
       idle_time = 0;
 
+    verify = 0;
     switch (x) {
     case 0x03: // RUN-STOP = make no change
     case 0x1b: // ESC
       return 0;
+    case 0x56: // V = verify slot against this file
+    case 0x76: // v
+      // there is nothing to verify against the erase entry
+      if (selection_number == 0)
+        break;
+      verify = 1;
+      // fall through
     case 0x0d: // Return = select this disk.
       // was erase (first entry) selected?
       if (selection_number == 0) {
@@ -859,7 +950,7 @@ unsigned char select_bitstream_file(unsigned char slot) {
       for (x = 63; x && disk_name_return[x] == ' '; x--)
         disk_name_return[x] = 0;
       disk_name_return[64] = 0;
-      return SELECTED_FILE_VALID;
+      return verify ? SELECTED_FILE_VERIFY : SELECTED_FILE_VALID;
 
     case 0x11:
     case 0x1d: // Cursor down or right
@@ -1040,25 +1131,15 @@ unsigned char j, k;
 unsigned short flash_time = 0, crc_time = 0, load_time = 0;
 
 unsigned char slot_empty_check(unsigned short mb_num) {
-  unsigned long addr;
-  for (addr = (mb_num * 1048576L); addr < ((mb_num * 1048576L) + SLOT_SIZE);
-       addr += 512) {
-    read_data(addr);
-    short y = 0xff;
-    for (short x = 0; x < 512; x++)
-      y &= data_buffer[x];
-    if (y != 0xff)
-      return -1;
-
-    *(unsigned long *)(0x0400) = addr;
-  }
+  if (flash_first_nonblank(mb_num * 1048576L, SLOT_SIZE) != FLASH_BLANK)
+    return -1;
   return 0;
 }
 
 void flash_inspector(void) {
 #ifdef QSPI_FLASH_INSPECT
   addr = 0;
-  read_data(addr);
+  read_data_to(addr, (unsigned long)data_buffer, 256);
   printf("Flash @ $%08x:\n", addr);
   for (i = 0; i < 256; i++) {
     if (!(i & 15))
@@ -1150,7 +1231,7 @@ void flash_inspector(void) {
         press_any_key(0, 0);
       }
 
-      read_data(addr);
+      read_data_to(addr, (unsigned long)data_buffer, 256);
       printf("%cFlash @ $%08lx:\n", 0x93, addr);
       for (i = 0; i < 256; i++) {
         if (!(i & 15))
@@ -1182,12 +1263,137 @@ void debug_memory_block(int offset, unsigned long dbg_addr) {
 }
 #endif
 
+/*
+  Adaptive write retry policy
+
+  Some boards (e.g. the 512S QSPI on R3A, see reflash_slot) show write errors,
+  most do not. Healthy boards should flash at full speed, so we only become
+  more careful after problems were seen:
+
+    FLASH_CAUTION_NONE   - program pages, verify the whole sector afterwards
+    FLASH_CAUTION_VERIFY - verify every 512 byte block as soon as both pages
+                           are programmed, reprogram it once if it differs
+    FLASH_CAUTION_SETTLE - additionally give the flash extra settle time
+                           after commands and slow down bitbashing
+
+  If all of this fails, the sector is erased and written again. After
+  FLASH_CAUTION_CALM sectors were written without problems, we step back down
+  one level.
+*/
+#define FLASH_CAUTION_NONE 0
+#define FLASH_CAUTION_VERIFY 1
+#define FLASH_CAUTION_SETTLE 2
+#define FLASH_CAUTION_CALM 16
+
+unsigned char flash_caution = FLASH_CAUTION_NONE;
+unsigned char flash_clean_sectors = 0;
+
+void flash_caution_raise(unsigned char level) {
+  if (flash_caution < level)
+    flash_caution = level;
+  flash_clean_sectors = 0;
+}
+
+void flash_caution_sector_done(unsigned char tries) {
+  if (tries > 1)
+    // this sector had to be rewritten
+    flash_caution_raise(FLASH_CAUTION_VERIFY);
+  else if (flash_caution && ++flash_clean_sectors == FLASH_CAUTION_CALM) {
+    flash_caution--;
+    flash_clean_sectors = 0;
+  }
+}
+
+/*
+  Flash telemetry
+
+  For every sector processed while flashing a slot, we record how often it
+  was erased and programmed, how many verify errors occurred, the PRGERR and
+  ERAERR flags seen in SR1 and how long it took (in video frames). This
+  helps to spot degrading flash chips before they fail.
+
+  The records are kept in chip RAM behind the file selector buffers, so they
+  can be downloaded (e.g. using the serial monitor) after flashing:
+
+    TELEMETRY_ADDRESS     header (telemetry_header_type)
+    TELEMETRY_ADDRESS+16  one telemetry_sector_type per sector, in the
+                          order they were flashed (top of slot first)
+*/
+#define TELEMETRY_ADDRESS 0x4e000L
+#define TELEMETRY_MAX 680
+#define TELEMETRY_MAGIC 0x4c54464dUL
+// MEGA65 video frame counter
+#define FRAMECOUNT 0xD7FAU
+
+typedef struct {
+  uint32_t magic;
+  unsigned short sectors;
+  unsigned short rewrites;
+  unsigned short verify_errors;
+  unsigned short prgerr;
+  unsigned short eraerr;
+  unsigned short frames;
+} telemetry_header_type;
+
+typedef struct {
+  uint32_t addr;
+  unsigned char erases;
+  unsigned char passes;
+  unsigned char verify_errors;
+  unsigned char prgerr;
+  unsigned char eraerr;
+  unsigned char caution;
+  unsigned short frames;
+} telemetry_sector_type;
+
+telemetry_header_type tele;
+telemetry_sector_type tele_sector;
+unsigned char tele_frame;
+
+void telemetry_start(void) {
+  memset(&tele, 0, sizeof(tele));
+  tele.magic = TELEMETRY_MAGIC;
+  lcopy((unsigned long)&tele, TELEMETRY_ADDRESS, sizeof(tele));
+}
+
+void telemetry_tick(void) {
+  unsigned char now = PEEK(FRAMECOUNT);
+  tele_sector.frames += (unsigned char)(now - tele_frame);
+  tele_frame = now;
+}
+
+void telemetry_sector_start(unsigned long sector_addr) {
+  memset(&tele_sector, 0, sizeof(tele_sector));
+  tele_sector.addr = sector_addr;
+  tele_frame = PEEK(FRAMECOUNT);
+}
+
+void telemetry_sector_done(void) {
+  telemetry_tick();
+  tele_sector.caution = flash_caution;
+
+  if (tele_sector.passes > 1)
+    tele.rewrites++;
+  tele.verify_errors += tele_sector.verify_errors;
+  tele.prgerr += tele_sector.prgerr;
+  tele.eraerr += tele_sector.eraerr;
+  tele.frames += tele_sector.frames;
+  if (tele.sectors < TELEMETRY_MAX)
+    lcopy((unsigned long)&tele_sector,
+          TELEMETRY_ADDRESS + sizeof(tele) + tele.sectors * sizeof(tele_sector),
+          sizeof(tele_sector));
+  tele.sectors++;
+  lcopy((unsigned long)&tele, TELEMETRY_ADDRESS, sizeof(tele));
+}
+
 unsigned char flash_region_differs(unsigned long attic_addr,
                                    unsigned long flash_addr, long size) {
+  qspi_stream_open(flash_addr);
   while (size > 0) {
 
     lcopy(0x8000000 + attic_addr, 0xffd6e00L, 512);
-    if (!verify_data_in_place(flash_addr)) {
+    if (!qspi_stream_verify512()) {
+      qspi_stream_close();
 #ifdef SHOW_FLASH_DIFF
       printf("\nVerify error  ");
       press_any_key(0, 0);
@@ -1208,21 +1414,677 @@ unsigned char flash_region_differs(unsigned long attic_addr,
     flash_addr += 512;
     size -= 512;
   }
+  qspi_stream_close();
+  return 0;
+}
+
+/*
+ * ulong flash_first_nonblank(flash_addr, size)
+ *
+ * blank check engine: loads an all 0xff pattern into the QSPI buffer once
+ * and uses the hardware verify to compare each 512 byte block against it.
+ * Stops at the first block that is not erased.
+ *
+ * returns the address of the first non-blank block, or FLASH_BLANK if the
+ * whole region is erased
+ */
+unsigned long flash_first_nonblank(unsigned long flash_addr,
+                                   unsigned long size) {
+  // Do a dummy read to clear any pending stuck QSPI commands
+  // (else we get incorrect return value from QSPI verify command)
+  while (!verify_data_in_place(0L))
+    read_data_in_place(0);
+
+  // the verify command does not alter the buffer, so we only fill it once
+  lfill(0xffd6e00L, 0xff, 512);
+  qspi_stream_open(flash_addr);
+  for (; size; size -= 512, flash_addr += 512)
+    if (!qspi_stream_verify512())
+      break;
+  qspi_stream_close();
+  return size ? flash_addr : FLASH_BLANK;
+}
+
+unsigned char program_attic_page(unsigned long attic_addr,
+                                 unsigned long flash_addr,
+                                 unsigned long next_attic_addr) {
+  unsigned char failed;
+
+  // display sector on screen
+  // lcopy(0x8000000L+attic_addr,0x0400+17*40,256);
+  POKE(0xD020, 3);
+  failed = program_page_from(0x8000000L + attic_addr, flash_addr, 256,
+                             next_attic_addr ? 0x8000000L + next_attic_addr
+                                             : 0);
+  POKE(0xD020, 0);
+  return failed;
+}
+
+/*
+ * uchar program_range(attic_addr, flash_addr, size)
+ *
+ * programs size bytes from attic RAM into flash, starting with the last
+ * page. Depending on flash_caution, each block is verified right away.
+ *
+ * returns 0 on success, 1 if the sector needs to be erased again
+ */
+unsigned char program_range(unsigned long attic_addr,
+                            unsigned long flash_addr, long size) {
+  while (size > 0) {
+    size -= 256;
+    if (flash_caution < FLASH_CAUTION_VERIFY || (size & 0x1ff)) {
+      // let the next page be staged while this one is programmed
+      if (program_attic_page(attic_addr + size, flash_addr + size,
+                             size ? attic_addr + size - 256 : 0))
+        return 1;
+      continue;
+    }
+
+    // the verify needs the buffer, so nothing can be staged
+    if (program_attic_page(attic_addr + size, flash_addr + size, 0))
+      return 1;
+
+    // both pages of this block are programmed
+    if (flash_region_differs(attic_addr + size, flash_addr + size, 512)) {
+      tele_sector.verify_errors++;
+      // programming again fixes bits that failed to clear, bits that were
+      // cleared but should not have been need an erase
+      if (program_attic_page(attic_addr + size + 256, flash_addr + size + 256,
+                             0) ||
+          program_attic_page(attic_addr + size, flash_addr + size, 0))
+        return 1;
+      if (flash_region_differs(attic_addr + size, flash_addr + size, 512)) {
+        tele_sector.verify_errors++;
+        flash_caution_raise(FLASH_CAUTION_SETTLE);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+  Program map
+
+  one bit for each 4k block of the slot (by attic address), set if the
+  block needs to be programmed. Filled by make_flash_plan, so that blocks
+  that are already correct in a sector that needs no erase are left alone.
+*/
+unsigned char program_map[256];
+
+#define PROGRAM_MAP_SET(A) program_map[(A) >> 15] |= 1 << (((A) >> 12) & 7)
+#define PROGRAM_MAP_CLEAR(A)                                                   \
+  program_map[(A) >> 15] &= ~(1 << (((A) >> 12) & 7))
+#define PROGRAM_MAP_TEST(A) (program_map[(A) >> 15] & (1 << (((A) >> 12) & 7)))
+
+/*
+ * program_map_fill(attic_addr, size)
+ *
+ * marks all 4k blocks of the range for programming
+ */
+void program_map_fill(unsigned long attic_addr, unsigned long size) {
+  for (; size; size -= 4096, attic_addr += 4096)
+    PROGRAM_MAP_SET(attic_addr);
+}
+
+/*
+ * uchar program_sector(attic_addr, flash_addr, size)
+ *
+ * programs the 4k blocks of a sector that are marked in program_map,
+ * starting with the last one
+ *
+ * returns 0 on success, 1 if the sector needs to be erased again
+ */
+unsigned char program_sector(unsigned long attic_addr,
+                             unsigned long flash_addr, long size) {
+  while (size > 0) {
+    size -= 4096;
+    if (PROGRAM_MAP_TEST(attic_addr + size) &&
+        program_range(attic_addr + size, flash_addr + size, 4096))
+      return 1;
+  }
   return 0;
 }
 
+/*
+  Flash journal
+
+  Records which core image is being flashed into which slot, and the lowest
+  sector address that has already been written successfully (we flash from
+  the top of the slot downwards). It is kept in the upper part of colour RAM,
+  which is not touched by us or the hypervisor and survives a warm reset, as
+  does the core image in attic RAM. If a flash gets interrupted, a restart
+  with the same core file can skip loading, checksumming and verifying and
+  continue with the first unfinished sector.
+*/
+#define FLASH_JOURNAL_ADDRESS 0xff87f00L
+#define FLASH_JOURNAL_MAGIC 0x4a4c464dUL
+
+typedef struct {
+  uint32_t magic;
+  uint32_t length;
+  uint32_t crc;
+  uint32_t addr;
+  unsigned char slot;
+} flash_journal_type;
+
+flash_journal_type journal;
+
+void journal_write(unsigned long next_addr) {
+  journal.addr = next_addr;
+  lcopy((unsigned long)&journal, FLASH_JOURNAL_ADDRESS, sizeof(journal));
+}
+
+void journal_clear(void) {
+  lfill(FLASH_JOURNAL_ADDRESS, 0, sizeof(journal));
+}
+
+/*
+ * uchar journal_resumable(slot)
+ *
+ * checks if the journal describes an interrupted flash of the core
+ * file whose header is in buffer into the given slot, and if attic RAM
+ * still holds that core image.
+ *
+ * returns 1 if the flash can be resumed
+ */
+unsigned char journal_resumable(unsigned char slot) {
+  unsigned char x;
+
+  lcopy(FLASH_JOURNAL_ADDRESS, (unsigned long)&journal, sizeof(journal));
+  if (journal.magic != FLASH_JOURNAL_MAGIC || journal.slot != slot ||
+      journal.length != *(uint32_t *)(buffer + 0x80) ||
+      journal.crc != *(uint32_t *)(buffer + 0x84))
+    return 0;
+
+  // attic RAM must still contain the same image
+  lcopy(0x8000000L, (unsigned long)data_buffer, 0x88);
+  for (x = 0; x < 16; x++)
+    if (data_buffer[x] != buffer[x])
+      return 0;
+  if (*(uint32_t *)(data_buffer + 0x80) != journal.length ||
+      *(uint32_t *)(data_buffer + 0x84) != journal.crc)
+    return 0;
+
+  return 1;
+}
+
+uint32_t core_crc;
+
+/*
+ * uchar core_crc_good(void)
+ *
+ * calculates the CRC32 checksum of the core in attic RAM and compares it
+ * with the one in its header, which is left in core_crc. addr_len is set
+ * to the core length from the header.
+ *
+ * returns 1 if the checksum matches
+ */
+unsigned char core_crc_good(void) {
+  // always do a CRC32 check!
+  printf("%cGenerating CRC32 checksum...\n", 0x93);
+  progress_start(addr_len >> 8, "Checksum");
+  // lets use two 512 byte buffers for our 1024 byte crc32 lookup table
+  make_crc32_tables(data_buffer, buffer);
+  init_crc32();
+  for (short y = 1, addr = 0; addr < addr_len; addr += 256) {
+    // we don't need the part string anymore, so we reuse this buffer
+    // note: part is only used in probe_qspi_flash
+    lcopy(0x8000000L + addr, (unsigned long)part, 256);
+    if (y) {
+      // the first sector has the real length and the CRC32
+      addr_len = *(uint32_t *)(part + 0x80);
+      progress_goal = addr_len >> 8;
+      core_crc = *(uint32_t *)(part + 0x84);
+      // set CRC bytes to pre-calculation value
+      *(uint32_t *)(part + 0x84) = 0xf0f0f0f0UL;
+
+      EIGHT_FROM_TOP;
+      printf("\n\nCORE Length = %08lx\n", addr_len);
+      printf("CORE CRC32  = %08lx", core_crc);
+
+      y = 0;
+    }
+    update_crc32(addr_len - addr > 255 ? 0 : addr_len - addr, part);
+    progress_bar(1, "Checksum");
+  }
+  progress_time(crc_time);
+  EIGHT_FROM_TOP;
+  printf("\n\n\nCALC CRC32  = %08lx\n", get_crc32());
+
+  return addr_len >= 4096 && core_crc == get_crc32();
+}
+
+/*
+ * uchar check_core_crc(slot)
+ *
+ * checks the CRC32 checksum of the core in attic RAM that is going to be
+ * flashed into slot, and records it in the journal.
+ *
+ * returns 1 if the core is good to flash, 0 to abort
+ */
+unsigned char check_core_crc(unsigned char slot) {
+  unsigned short bytes_returned;
+
+  if (!core_crc_good()) {
+    printf("\n%cCHECKSUM MISMATCH%c\n", 28, 5);
+    // no second chance for slot 0, and a copy of a damaged slot would
+    // not be any better
+    if (slot == 0 || copy_source_slot != 0xff) {
+      printf("\nRefusing to flash slot %d!\n", slot);
+      press_any_key(0, 0);
+      return 0;
+    } else {
+      printf("\nPress F10 to flash anyway, or any other key to abort.\n", 28,
+             5);
+      bytes_returned = press_any_key(0, 1);
+      if (bytes_returned != 0xfa)
+        return 0;
+    }
+  } else {
+    printf("\n%cChecksum matches, good to flash.%c\n", 30, 5);
+    bytes_returned = press_any_key(0, 0);
+    if (bytes_returned == 0x03 || bytes_returned == 0x1b)
+      return 0;
+  }
+
+  journal.magic = FLASH_JOURNAL_MAGIC;
+  journal.slot = slot;
+  journal.length = addr_len;
+  journal.crc = core_crc;
+
+  return 1;
+}
+
+/*
+ * uchar load_core_file(slot)
+ *
+ * loads the core file disk_name_return into attic RAM and checks
+ * its CRC32 checksum.
+ *
+ * returns 1 if the core is good to flash, 0 to abort
+ */
+unsigned char load_core_file(unsigned char slot) {
+  unsigned short bytes_returned;
+
+  // start reading file from beginning again
+  // (as the model_id checking read the first 512 bytes already)
+  hy_open(disk_name_return);
+
+  printf("%cLoading COR file into Attic RAM...\n", 0x93);
+  progress_start(SLOT_SIZE_PAGES, "Loading");
+
+  for (addr = 0; addr < SLOT_SIZE; addr += 512) {
+    bytes_returned = hy_read512();
+    if (!bytes_returned)
+      break;
+    lcopy(0xffd6e00L, 0x8000000L + addr, 512);
+    progress_bar(2, "Loading");
+  }
+  addr_len = addr; // save last sector
+  // fill rest of attic ram with emptiness
+  for (; addr < SLOT_SIZE; addr += 512) {
+    lfill(0x8000000L + addr, 0xff, 512);
+    progress_bar(2, "Filling");
+  }
+  progress_time(load_time);
+  hy_close();
+  // printf("%c%cLoaded COR file in %u seconds.\n", 0x11, 0x11, load_time);
+
+  return check_core_crc(slot);
+}
+
+/*
+ * uchar load_core_slot(source_slot, slot)
+ *
+ * reads the core in source_slot into attic RAM, so it can be flashed
+ * into slot, and checks its CRC32 checksum.
+ *
+ * returns 1 if the core is good to flash, 0 to abort
+ */
+unsigned char load_core_slot(unsigned char source_slot, unsigned char slot) {
+  unsigned long source_addr = SLOT_SIZE * source_slot;
+
+  printf("%cReading slot %d into Attic RAM...\n", 0x93, source_slot);
+
+  // the header tells us how much we need to read
+  read_data_to(source_addr, (unsigned long)data_buffer, 0x88);
+  addr_len = *(uint32_t *)(data_buffer + 0x80);
+  if (addr_len < 4096 || addr_len > SLOT_SIZE) {
+    printf("\n%cERROR: Slot %d has no valid core length!%c\n", 28, source_slot,
+           5);
+    press_any_key(0, 0);
+    return 0;
+  }
+  addr_len = (addr_len + 511) & ~511UL;
+
+  progress_start(SLOT_SIZE_PAGES, "Reading");
+  qspi_stream_open(source_addr);
+  for (addr = 0; addr < addr_len; addr += 512) {
+    qspi_stream_next512(0x8000000L + addr);
+    progress_bar(2, "Reading");
+  }
+  qspi_stream_close();
+  for (; addr < SLOT_SIZE; addr += 512) {
+    lfill(0x8000000L + addr, 0xff, 512);
+    progress_bar(2, "Filling");
+  }
+  progress_time(load_time);
+
+  return check_core_crc(slot);
+}
+
+/*
+ * verify_slot_file(slot)
+ *
+ * compares the core file disk_name_return against the slot without
+ * writing anything. The file is streamed from SD card and each sector
+ * lands in the QSPI buffer, so it is verified against flash right away.
+ * A copy goes to attic RAM for the CRC32 check at the end.
+ */
+void verify_slot_file(unsigned char slot) {
+  unsigned long size, offset, slot_addr = SLOT_SIZE * slot;
+  unsigned short same = 0, differs = 0, blank = 0, bytes_returned = 512;
+  unsigned char sector_same;
+
+  if (hy_open(disk_name_return) == 0xff) {
+    printf("%c\n%cERROR: Could not open core file!%c\n", 0x93, 25, 3);
+    press_any_key(0, 0);
+    return;
+  }
+
+  printf("%cVerifying slot %d against file...\n", 0x93, slot);
+  lcopy((long)disk_display_return, SCREEN_ADDRESS + 40, 40);
+  progress_start(SLOT_SIZE_PAGES, "Verifying");
+
+  addr_len = 0;
+  for (addr = 0; addr < SLOT_SIZE; addr += size) {
+    if (slot_addr + addr < (unsigned long)num_4k_sectors << 12)
+      size = 4096;
+    else
+      size = 1L << flash_sector_bits;
+    printf("%c  Verifying sector at $%08lX/%07lX", 0x13, slot_addr + addr,
+           addr);
+
+    sector_same = 1;
+    for (offset = 0; offset < size; offset += 512) {
+      if (bytes_returned)
+        bytes_returned = hy_read512();
+      // past the end of the file, the slot should be empty
+      if (!bytes_returned)
+        lfill(0xffd6e00L, 0xff, 512);
+      else
+        addr_len = addr + offset + 512;
+      lcopy(0xffd6e00L, 0x8000000L + addr + offset, 512);
+
+      // Do a dummy read to clear any pending stuck QSPI commands left by
+      // the SD card access, then put the file data back
+      while (!verify_data_in_place(0L))
+        read_data_in_place(0);
+      lcopy(0x8000000L + addr + offset, 0xffd6e00L, 512);
+      if (!verify_data_in_place(slot_addr + addr + offset))
+        sector_same = 0;
+    }
+
+    if (sector_same)
+      same++;
+    else if (flash_region_blank(slot_addr + addr, size))
+      blank++;
+    else
+      differs++;
+    progress_bar(size >> 8, "Verifying");
+  }
+  progress_time(load_time);
+  hy_close();
+
+  printf("%c", 0x93);
+  bytes_returned = core_crc_good();
+  EIGHT_FROM_TOP;
+  printf("\n\n\n\n\n%cChecksum %s.%c\n\n"
+         "  Matching: %u sectors\n"
+         " Differing: %u sectors\n"
+         "     Blank: %u sectors\n\n"
+         "  Verify: %u sec\n\n"
+         "%cSlot %s the file.%c\n\n",
+         bytes_returned ? 30 : 28, bytes_returned ? "matches" : "MISMATCH",
+         5, same, differs, blank, load_time,
+         differs || blank ? 28 : 30,
+         differs || blank ? "does NOT match" : "matches", 5);
+
+  press_any_key(1, 0);
+}
+
+/*
+ * ulong sector_size_below(addr)
+ *
+ * returns the size of the flash sector that ends at addr
+ */
+unsigned long sector_size_below(unsigned long addr) {
+  if (addr <= (unsigned long)num_4k_sectors << 12)
+    return 4096;
+  return 1L << ((long)flash_sector_bits);
+}
+
+/*
+  Flash plan
+
+  Before anything is written, every sector of the slot is compared against
+  the image in attic RAM and gets one entry in flash_plan, counting from the
+  top of the slot, as this is the order we flash in. The flash loop then
+  works from the plan instead of verifying every sector again.
+*/
+#define FLASH_PLAN_SAME 0
+#define FLASH_PLAN_PROGRAM 1
+#define FLASH_PLAN_ERASE 2
+// a slot of 64k sectors plus the 4k parameter sectors fits easily
+#define FLASH_PLAN_MAX 256
+
+unsigned char flash_plan[FLASH_PLAN_MAX];
+unsigned short plan_count[3];
+
+// the top 4k sector of a large sector in the parameter sector area, erase
+// the whole large sector at once
+#define FLASH_PLAN_ERASE_WIDE 3
+
+/*
+ * erase_type_type *find_erase_type(size_bits)
+ *
+ * returns the erase type for the given erase size, or the largest one
+ */
+erase_type_type *find_erase_type(unsigned char size_bits) {
+  unsigned char i;
+  for (i = 0; i < erase_type_count - 1; i++)
+    if (erase_types[i].size_bits == size_bits)
+      break;
+  return erase_types + i;
+}
+
+// typical time to program a range, using 256 byte pages
+#define program_time_ms(SIZE) ((((SIZE) >> 8) << page_time_bits) / 1000)
+
+/*
+ * uchar plan_sector(attic_addr, flash_addr, size, erased)
+ *
+ * compares a sector against attic RAM in 4k blocks and marks the blocks
+ * that need programming in program_map. If erased is set, the sector
+ * will be erased by then.
+ *
+ * returns the FLASH_PLAN action for the sector
+ */
+unsigned char plan_sector(unsigned long attic_addr, unsigned long flash_addr,
+                          unsigned long size, unsigned char erased) {
+  unsigned long offset;
+  unsigned char action = FLASH_PLAN_SAME;
+
+  for (offset = 0; offset < size; offset += 4096) {
+    PROGRAM_MAP_CLEAR(attic_addr + offset);
+    if (!flash_region_differs(attic_addr + offset, flash_addr + offset, 4096))
+      continue;
+    PROGRAM_MAP_SET(attic_addr + offset);
+    if (action == FLASH_PLAN_SAME)
+      action = FLASH_PLAN_PROGRAM;
+    if (!erased && !flash_region_blank(flash_addr + offset, 4096))
+      action = FLASH_PLAN_ERASE;
+  }
+
+  if (action == FLASH_PLAN_ERASE || erased)
+    // after the erase, everything that is not blank needs to be written
+    for (offset = 0; offset < size; offset += 4096)
+      if (!PROGRAM_MAP_TEST(attic_addr + offset) &&
+          !flash_region_blank(flash_addr + offset, 4096)) {
+        PROGRAM_MAP_SET(attic_addr + offset);
+        if (action == FLASH_PLAN_SAME)
+          action = FLASH_PLAN_PROGRAM;
+      }
+
+  return action;
+}
+
+/*
+ * ulong make_flash_plan(top_addr, end_addr, erased_below)
+ *
+ * fills flash_plan, program_map and plan_count for the sectors between
+ * end_addr (the start of the slot) and top_addr. Sectors below
+ * erased_below will be erased by erase_some_sectors before flashing starts.
+ *
+ * In the 4k parameter sector area, a large sector worth of 4k sectors is
+ * erased with one large erase, if that is cheaper than erasing the
+ * changed 4k sectors one by one, even though it means programming all
+ * of them again. The 4k sectors are at the start of slot 0, inside the
+ * first 1MB that a fresh flash erases beforehand, so this only applies
+ * when resuming a flash of slot 0.
+ *
+ * returns the estimated erase and program time in ms
+ */
+unsigned long make_flash_plan(unsigned long top_addr, unsigned long end_addr,
+                              unsigned long erased_below) {
+  unsigned long size, offset, sector_ms, span_ms = 0, est_ms = 0;
+  unsigned long large_size = 1L << flash_sector_bits;
+  unsigned char *plan = flash_plan, *span_plan = 0;
+
+  printf("%cPlanning flash update...\n", 0x93);
+  progress_start((top_addr - end_addr) >> 8, "Planning");
+
+  // Do a dummy read to clear any pending stuck QSPI commands
+  // (else we get incorrect return value from QSPI verify command)
+  while (!verify_data_in_place(0L))
+    read_data_in_place(0);
+
+  while (top_addr > end_addr) {
+    size = sector_size_below(top_addr);
+    top_addr -= size;
+    printf("%c  Verifying sector at $%08lX/%07lX", 0x13, top_addr,
+           top_addr - end_addr);
+
+    sector_ms = 0;
+    if (top_addr < erased_below) {
+      // erase_some_sectors makes its own choice of erase size
+      if (!flash_region_blank(top_addr, size))
+        sector_ms += find_erase_type(size == 4096 ? 12 : flash_sector_bits)
+                         ->time_ms;
+      *plan = plan_sector(top_addr - end_addr, top_addr, size, 1);
+    } else
+      *plan = plan_sector(top_addr - end_addr, top_addr, size, 0);
+    if (*plan == FLASH_PLAN_ERASE)
+      sector_ms += find_erase_type(size == 4096 ? 12 : flash_sector_bits)
+                       ->time_ms;
+    for (offset = 0; offset < size; offset += 4096)
+      if (PROGRAM_MAP_TEST(top_addr - end_addr + offset))
+        sector_ms += program_time_ms(4096);
+
+    // the top 4k sector of a large sector starts a span of parameter
+    // sectors that could be erased at once
+    if (size == 4096 && top_addr >= erased_below &&
+        !((top_addr + 4096) & (large_size - 1))) {
+      span_plan = plan;
+      span_ms = 0;
+    }
+    plan++;
+
+    if (!span_plan)
+      est_ms += sector_ms;
+    else {
+      span_ms += sector_ms;
+      if (!(top_addr & (large_size - 1))) {
+        // whole span planned, is one large erase cheaper?
+        sector_ms = find_erase_type(flash_sector_bits)->time_ms +
+                    program_time_ms(large_size);
+        if (sector_ms < span_ms) {
+          program_map_fill(top_addr - end_addr, large_size);
+          *span_plan = FLASH_PLAN_ERASE_WIDE;
+          while (++span_plan < plan)
+            *span_plan = FLASH_PLAN_PROGRAM;
+          span_ms = sector_ms;
+        }
+        est_ms += span_ms;
+        span_plan = 0;
+      }
+    }
+
+    progress_bar(size >> 8, "Planning");
+  }
+
+  plan_count[FLASH_PLAN_SAME] = plan_count[FLASH_PLAN_PROGRAM] =
+      plan_count[FLASH_PLAN_ERASE] = 0;
+  for (span_plan = flash_plan; span_plan < plan; span_plan++)
+    if (*span_plan == FLASH_PLAN_ERASE_WIDE)
+      plan_count[FLASH_PLAN_ERASE]++;
+    else
+      plan_count[*span_plan]++;
+
+  return est_ms;
+}
+
+/*
+ * uchar confirm_flash_plan(est_ms)
+ *
+ * shows the flash plan and asks if we should go ahead
+ *
+ * returns 1 to flash now, 0 to postpone
+ */
+unsigned char confirm_flash_plan(unsigned long est_ms) {
+  unsigned short est_sec = (est_ms + 999) / 1000;
+
+  printf("%cFlash plan:\n\n"
+         "  Unchanged: %u sectors\n"
+         "    Program: %u sectors\n"
+         "    Erase+Program: %u sectors\n\n",
+         0x93, plan_count[FLASH_PLAN_SAME], plan_count[FLASH_PLAN_PROGRAM],
+         plan_count[FLASH_PLAN_ERASE]);
+  if (load_time)
+    printf("  Load: %u sec (%u KB/sec)\n", load_time,
+           (unsigned short)((addr_len >> 10) / load_time));
+  printf("  Estimated flash time: %u sec\n"
+         "  Estimated total: %u sec\n\n"
+         "Flash now? (y/n)\n\n",
+         est_sec, load_time + crc_time + est_sec);
+
+  return check_input("y", CASE_INSENSITIVE);
+}
+
 void reflash_slot(unsigned char the_slot, unsigned char selected_file,
                   char *slot0version) {
-  unsigned long size, waddr, end_addr;
-  unsigned short bytes_returned;
-  unsigned char fd, tries;
-  unsigned char erase_mode = 0;
+  unsigned long size, end_addr, erased_below;
+  unsigned char fd, tries, action;
+  unsigned char *plan;
+  unsigned char resume = 0;
   unsigned char slot = the_slot;
-  uint32_t core_crc;
 
   if (selected_file == SELECTED_FILE_INVALID)
     return;
 
+  if (selected_file == SELECTED_FILE_VERIFY) {
+    hy_closeall();
+    verify_slot_file(slot);
+    return;
+  }
+
+  if (flash_read_only) {
+    printf("%c%c\nCannot write to %s flash!%c\n\n", 0x93, 0x1c, part, 0x5);
+    press_any_key(0, 0);
+    return;
+  }
+
 #ifndef QSPI_ERASE_ZERO
   if (selected_file == 1 && slot == 0) {
     // we refuse to erase slot 0
@@ -1236,11 +2098,6 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
 
   hy_closeall();
 
-  // Read a few times to make sure transient initial read problems disappear
-  read_data(0);
-  read_data(0);
-  read_data(0);
-
   /*
     The 512S QSPI on the R3A boards _sometimes_ suffer high write error rates
     that can often be worked around by processing flash sector at a time, so
@@ -1274,144 +2131,118 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
   lfill((unsigned long)buffer, 0, 512);
 
   // return code of select_bitstream_file > 1 means a file was selected
-  if (selected_file == SELECTED_FILE_VALID) {
-    printf("%cChecking core file...\n\n", 0x93);
-    lcopy((long)disk_display_return, SCREEN_ADDRESS + 40, 40);
-
-    fd = hy_open(disk_name_return);
-    if (fd == 0xff) {
-      // Couldn't open the file.
-      printf("\n%cERROR: Could not open core file!%c\n", 25, 3);
-      press_any_key(0, 0);
-      return;
-    }
-
-    printf("\n");
+  if (selected_file == SELECTED_FILE_VALID ||
+      selected_file == SELECTED_FILE_COPY) {
+    if (selected_file == SELECTED_FILE_COPY) {
+      // slot 0 is only ever flashed from its upgrade file
+      if (slot == 0 || copy_source_slot == slot) {
+        printf("%c%c\nRefusing to copy into slot %d!%c\n\n", 0x93, 0x1c,
+               slot, 0x5);
+        press_any_key(0, 0);
+        return;
+      }
+      if (!load_core_slot(copy_source_slot, slot))
+        return;
+    } else {
+      printf("%cChecking core file...\n\n", 0x93);
+      lcopy((long)disk_display_return, SCREEN_ADDRESS + 40, 40);
 
-    // TODO: also check NAME "MEGA65" for slot 0 flash!
-    if (!check_model_id_field(slot == 0 ? 1 : 0, slot0version))
-      return;
+      fd = hy_open(disk_name_return);
+      if (fd == 0xff) {
+        // Couldn't open the file.
+        printf("\n%cERROR: Could not open core file!%c\n", 25, 3);
+        press_any_key(0, 0);
+        return;
+      }
 
-#if defined(STANDALONE) && defined(QSPI_DEBUG)
-    printf("%c", 0x93);
-    make_crc32_tables(data_buffer, buffer);
-    init_crc32();
-    update_crc32(11, "hello world");
-    printf("\n\nhello world CRC32 = %08lX\n", get_crc32());
-    press_any_key(0, 0);
-#endif
+      printf("\n");
 
-    // start reading file from beginning again
-    // (as the model_id checking read the first 512 bytes already)
-    fd = hy_open(disk_name_return);
+      // TODO: also check NAME "MEGA65" for slot 0 flash!
+      if (!check_model_id_field(slot == 0 ? 1 : 0, slot0version))
+        return;
 
-    printf("%cLoading COR file into Attic RAM...\n", 0x93);
-    progress_start(SLOT_SIZE_PAGES, "Loading");
+#if defined(STANDALONE) && defined(QSPI_DEBUG)
+      printf("%c", 0x93);
+      make_crc32_tables(data_buffer, buffer);
+      init_crc32();
+      update_crc32(11, "hello world");
+      printf("\n\nhello world CRC32 = %08lX\n", get_crc32());
+      press_any_key(0, 0);
+#endif
 
-    for (addr = 0; addr < SLOT_SIZE; addr += 512) {
-      bytes_returned = hy_read512();
-      if (!bytes_returned)
-        break;
-      lcopy(0xffd6e00L, 0x8000000L + addr, 512);
-      progress_bar(2, "Loading");
-    }
-    addr_len = addr; // save last sector
-    // fill rest of attic ram with emptiness
-    for (; addr < SLOT_SIZE; addr += 512) {
-      lfill(addr, 0xff, 512);
-      progress_bar(2, "Filling");
-    }
-    progress_time(load_time);
-    hy_close();
-    // printf("%c%cLoaded COR file in %u seconds.\n", 0x11, 0x11, load_time);
-
-    // always do a CRC32 check!
-    printf("%cGenerating CRC32 checksum...\n", 0x93);
-    progress_start(addr_len >> 8, "Checksum");
-    // lets use two 512 byte buffers for our 1024 byte crc32 lookup table
-    make_crc32_tables(data_buffer, buffer);
-    init_crc32();
-    for (short y = 1, addr = 0; addr < addr_len; addr += 256) {
-      // we don't need the part string anymore, so we reuse this buffer
-      // note: part is only used in probe_qspi_flash
-      lcopy(0x8000000L + addr, (unsigned long)part, 256);
-      if (y) {
-        // the first sector has the real length and the CRC32
-        addr_len = *(uint32_t *)(part + 0x80);
-        progress_goal = addr_len >> 8;
-        core_crc = *(uint32_t *)(part + 0x84);
-        // set CRC bytes to pre-calculation value
-        *(uint32_t *)(part + 0x84) = 0xf0f0f0f0UL;
-
-        EIGHT_FROM_TOP;
-        printf("\n\nCORE Length = %08lx\n", addr_len);
-        printf("CORE CRC32  = %08lx", core_crc);
-
-        y = 0;
-      }
-      update_crc32(addr_len - addr > 255 ? 0 : addr_len - addr, part);
-      progress_bar(1, "Checksum");
-    }
-    progress_time(crc_time);
-    EIGHT_FROM_TOP;
-    printf("\n\n\nCALC CRC32  = %08lx\n", get_crc32());
-
-    if (addr_len < 4096 || core_crc != get_crc32()) {
-      printf("\n%cCHECKSUM MISMATCH%c\n", 28, 5);
-      if (slot == 0) {
-        printf("\nRefusing to flash slot 0!\n");
-        press_any_key(0, 0);
-        return;
-      } else {
-        printf("\nPress F10 to flash anyway, or any other key to abort.\n", 28,
-               5);
-        bytes_returned = press_any_key(0, 1);
-        if (bytes_returned != 0xfa)
-          return;
+      // the header read by check_model_id_field is still in buffer
+      resume = journal_resumable(slot);
+      if (resume) {
+        if (journal.addr == SLOT_SIZE * (slot + 1))
+          printf("%c\nFlashing this core into slot %d was\n"
+                 "postponed.\n\n",
+                 0x93, slot);
+        else
+          printf("%c\nFlashing this core into slot %d was\n"
+                 "interrupted at $%08lX.\n\n",
+                 0x93, slot, journal.addr);
+        printf("Resume flashing? (y/n)\n\n");
+        if (!check_input("y", CASE_INSENSITIVE))
+          resume = 0;
+        load_time = crc_time = 0;
       }
-    } else {
-      printf("\n%cChecksum matches, good to flash.%c\n", 30, 5);
-      bytes_returned = press_any_key(0, 0);
-      if (bytes_returned == 0x03 || bytes_returned == 0x1b)
+
+      if (!resume && !load_core_file(slot))
         return;
     }
 
+    end_addr = SLOT_SIZE * slot;
+    if (resume)
+      addr = journal.addr;
+    else
+      addr = end_addr + SLOT_SIZE;
+    // tests with Senfsosse showed that erasing 256k or 512k of the start of
+    // the slot were not enough to ensure slot 1 boot, so we erase the first
+    // 1MB, unless an interrupted flash already did that
+    if (addr == end_addr + SLOT_SIZE)
+      erased_below = end_addr + 1024L * 1024L;
+    else
+      erased_below = end_addr;
+
+    if (!confirm_flash_plan(make_flash_plan(addr, end_addr, erased_below))) {
+      // keep the loaded core, so the flash can be resumed later
+      journal_write(addr);
+      printf("Flashing postponed. Select the same\n"
+             "core file for this slot again to\n"
+             "flash it without loading it again.\n\n");
+      press_any_key(0, 0);
+      return;
+    }
+
     // start flashing
     printf("%c", 0x93);
     progress_start(SLOT_SIZE_PAGES, "Flashing");
-    // erase first 256k first
-    end_addr = addr = SLOT_SIZE * slot;
-    // tests with Senfsosse showed that 256k or 512k were not enough to ensure
-    // slot 1 boot
-    erase_some_sectors(addr + 1024L * 1024L, 0);
-    // start at the end...
-    addr = end_addr + SLOT_SIZE;
+    progress_total = (end_addr + SLOT_SIZE - addr) >> 8;
+    if (erased_below != end_addr) {
+      // erase_some_sectors works upwards from global addr
+      addr = end_addr;
+      erase_some_sectors(erased_below, 0);
+      addr = end_addr + SLOT_SIZE;
+    }
+    journal_write(addr);
+    telemetry_start();
+    plan = flash_plan;
     while (addr > end_addr) {
-      if (addr <= (unsigned long)num_4k_sectors << 12)
-        size = 4096;
-      else
-        size = 1L << ((long)flash_sector_bits);
+      size = sector_size_below(addr);
       addr -= size;
-#if 0
-      printf("\n%d %08lX %08lX", num_4k_sectors, (unsigned long)num_4k_sectors << 12, addr);
-      printf("\nsize = %ld", size);
-      press_any_key(0, 0);
-#endif
+
+      telemetry_sector_start(addr);
+      action = *plan++;
 
       // Do a dummy read to clear any pending stuck QSPI commands
       // (else we get incorrect return value from QSPI verify command)
-      while (!verify_data_in_place(0L))
-        read_data(0);
+      if (action != FLASH_PLAN_SAME)
+        while (!verify_data_in_place(0L))
+          read_data_in_place(0);
 
       // try 10 times to erase/write the sector
       tries = 0;
-      do {
-        // Verify the sector to see if it is already correct
-        printf("%c  Verifying sector at $%08lX/%07lX", 0x13, addr,
-               addr - SLOT_SIZE * slot);
-        if (!flash_region_differs(addr - SLOT_SIZE * slot, addr, size))
-          break;
-
+      while (action != FLASH_PLAN_SAME) {
         // if we failed 10 times, we abort with the option for the flash
         // inspector
         if (tries == 10) {
@@ -1447,29 +2278,44 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
         // next try to erase/program the sector
         tries++;
 
-        // Erase Sector
-        printf("%c    Erasing sector at $%08lX", 0x13, addr);
-        POKE(0xD020, 2);
-        erase_sector(addr);
-        read_data(0xffffffff);
-        POKE(0xD020, 0);
+        if (action != FLASH_PLAN_PROGRAM) {
+          printf("%c    Erasing sector at $%08lX", 0x13, addr);
+          POKE(0xD020, 2);
+          tele_sector.erases++;
+          if (action == FLASH_PLAN_ERASE_WIDE)
+            erase_sector_bits(addr & ~((1L << flash_sector_bits) - 1),
+                              flash_sector_bits);
+          else
+            erase_sector_bits(addr, size == 4096 ? 12 : flash_sector_bits);
+          read_data_in_place(0xffffffff);
+          POKE(0xD020, 0);
+          telemetry_tick();
+        }
 
-        // Program sector
         printf("%cProgramming sector at $%08lX", 0x13, addr);
-        for (waddr = addr + size; waddr > addr; waddr -= 256) {
-          lcopy(0x8000000L + waddr - 256 - SLOT_SIZE * slot,
-                (unsigned long)data_buffer, 256);
-          // display sector on screen
-          // lcopy(0x8000000L+waddr-SLOT_SIZE*slot,0x0400+17*40,256);
-          POKE(0xD020, 3);
-          program_page(waddr - 256, 256);
-          POKE(0xD020, 0);
+        tele_sector.passes++;
+        if (!program_sector(addr - end_addr, addr, size)) {
+          telemetry_tick();
+          printf("%c  Verifying sector at $%08lX/%07lX", 0x13, addr,
+                 addr - end_addr);
+          if (!flash_region_differs(addr - end_addr, addr, size))
+            break;
+          tele_sector.verify_errors++;
         }
-      } while (tries < 11);
+        telemetry_tick();
+        // bits that got cleared by mistake can only be fixed by an erase,
+        // which means the whole sector needs to be programmed
+        action = FLASH_PLAN_ERASE;
+        program_map_fill(addr - end_addr, size);
+      }
 
+      flash_caution_sector_done(tries);
+      telemetry_sector_done();
+      journal_write(addr);
       progress_bar(size >> 8, "Flashing");
     }
     progress_time(flash_time);
+    journal_clear();
 
     // Undraw the sector display before showing results
     lfill(0x0400 + 12 * 40, 0x20, 512);
@@ -1482,7 +2328,8 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
       return;
     printf("%c", 0x93);
 
-    // Erase mode
+    // Erase mode, an interrupted flash can't be resumed afterwards
+    journal_clear();
     progress_start(SLOT_SIZE_PAGES, "Erasing");
     addr = SLOT_SIZE * slot;
     erase_some_sectors(addr + SLOT_SIZE, 1);
@@ -1499,6 +2346,15 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
            "   Flash: %d sec \n"
            "\n",
            load_time, crc_time, flash_time);
+  if (selected_file == SELECTED_FILE_VALID ||
+      selected_file == SELECTED_FILE_COPY)
+    printf(" Rewrite: %u of %u sectors \n"
+           "  Verify: %u errors \n"
+           "  PRGERR: %u \n"
+           "  ERAERR: %u \n\n"
+           "Telemetry is at $%05lX.\n",
+           tele.rewrites, tele.sectors, tele.verify_errors, tele.prgerr,
+           tele.eraerr, TELEMETRY_ADDRESS);
 
   press_any_key(1, 0);
 
@@ -1511,11 +2367,142 @@ void reflash_slot(unsigned char the_slot, unsigned char selected_file,
 
  ***************************************************************************/
 
+/*
+  SPI command descriptors, run by spi_command
+
+  opcode, address bytes, dummy clocks, bytes sent from spi_cmd_data after
+  the address, bytes received into spi_cmd_data, flags
+*/
+// clang-format off
+const spi_cmd_type spi_cmd_wren   = { 0x06, 0, 0, 0, 0, 0 };
+const spi_cmd_type spi_cmd_wrdi   = { 0x04, 0, 0, 0, 0, 0 };
+const spi_cmd_type spi_cmd_wrr    = { 0x01, 0, 0, 2, 0, 0 };
+const spi_cmd_type spi_cmd_clsr   = { 0x30, 0, 0, 0, 0, 0 };
+const spi_cmd_type spi_cmd_rdsr1  = { 0x05, 0, 0, 0, 1, 0 };
+const spi_cmd_type spi_cmd_rdcr1  = { 0x35, 0, 0, 0, 1, 0 };
+const spi_cmd_type spi_cmd_dybrd  = { 0xe0, 4, 0, 0, 1, 0 };
+const spi_cmd_type spi_cmd_dybwr  = { 0xe1, 4, 0, 1, 0, SPI_CMD_CLOCK_LOW };
+const spi_cmd_type spi_cmd_ppbrd  = { 0xe2, 4, 0, 0, 1, 0 };
+const spi_cmd_type spi_cmd_ppblrd = { 0xa7, 0, 0, 0, 1, 0 };
+const spi_cmd_type spi_cmd_reset  = { 0xf0, 0, 0, 0, 0, 0 };
+const spi_cmd_type spi_cmd_rdsfdp = { 0x5a, 3, 8, 0, 4, 0 };
+// clang-format on
+
+/*
+ * vendor find_flash_vendor(id)
+ *
+ * returns the entry of the manufacturer id, or the unknown entry
+ */
+flash_vendor_type *find_flash_vendor(unsigned char id) {
+  flash_vendor_type *vendor;
+
+  for (vendor = flash_vendors; vendor->id && vendor->id != id; vendor++)
+    continue;
+  return vendor;
+}
+
+/*
+ * ulong sfdp_dword(addr)
+ *
+ * reads a 32 bit word from the SFDP tables of the flash
+ */
+unsigned long sfdp_dword(unsigned long addr) {
+  spi_command(&spi_cmd_rdsfdp, addr);
+  return *(uint32_t *)spi_cmd_data;
+}
+
+/*
+ * uchar probe_sfdp(void)
+ *
+ * reads density, erase types and times, and page size and program time
+ * from the JEDEC basic flash parameter table
+ *
+ * returns 1 if the flash has SFDP
+ */
+unsigned char probe_sfdp(void) {
+  static const unsigned short erase_units[4] = {1, 16, 128, 1000};
+  unsigned long bfpt, dw, times = 0;
+  unsigned char len, i, j, bits;
+
+  if (sfdp_dword(0) != 0x50444653UL) // "SFDP"
+    return 0;
+  // the first parameter header is for the basic flash parameter table
+  len = sfdp_dword(8) >> 24;
+  bfpt = sfdp_dword(12) & 0xffffffUL;
+
+  // DW2: density in bits, or 2^n bits if bit 31 is set
+  dw = sfdp_dword(bfpt + 4);
+  if (dw & 0x80000000UL)
+    flash_size_bits = (dw & 0xff) - 3;
+  else
+    for (flash_size_bits = -3; dw; dw >>= 1)
+      flash_size_bits++;
+
+  // DW1: 3 byte addresses only, 3 or 4, or 4 only
+  dw = (sfdp_dword(bfpt) >> 17) & 3;
+  // no 4 byte address mode (0xb7), it would still be set for the
+  // reconfig. The 4 byte address opcodes like 0x13 work without it.
+  flash_addr_bytes = 3;
+  if (dw == 2 || (dw == 1 && flash_size_bits > 24))
+    flash_addr_bytes = 4;
+
+  // DW8/9: erase types as 2^n size and opcode, DW10: typical times
+  if (len >= 10)
+    times = sfdp_dword(bfpt + 36) >> 4;
+  erase_type_count = 0;
+  flash_sector_bits = 0;
+  for (i = 0; i < 4; i++, times >>= 7) {
+    dw = sfdp_dword(bfpt + 28 + ((i >> 1) << 2)) >> ((i & 1) << 4);
+    bits = dw;
+    // skip unused types, and ones too large to plan with
+    if (!bits || bits > 18)
+      continue;
+    // keep the table sorted, smallest first
+    for (j = erase_type_count; j && erase_types[j - 1].size_bits > bits; j--)
+      erase_types[j] = erase_types[j - 1];
+    erase_types[j].size_bits = bits;
+    erase_types[j].opcode = dw >> 8;
+    erase_types[j].time_ms =
+        ((times & 0x1f) + 1) * erase_units[(times >> 5) & 3];
+    erase_type_count++;
+    if (bits > flash_sector_bits)
+      flash_sector_bits = bits;
+  }
+  // 4k erase may work everywhere, but we plan in large sectors
+  num_4k_sectors = 0;
+
+  // DW11: page size and typical page program time
+  page_size = 256;
+  page_time_bits = 10;
+  if (len >= 11) {
+    dw = sfdp_dword(bfpt + 40);
+    page_size = 1 << ((dw >> 4) & 0xf);
+    dw = (((dw >> 8) & 0x1f) + 1) << (dw & 0x2000 ? 6 : 3);
+    for (page_time_bits = 0; dw > 1; dw >>= 1)
+      page_time_bits++;
+  }
+
+  strcpy((char *)part, flash_vendor->name);
+
+#ifdef QSPI_VERBOSE
+  printf("SFDP         = %d dwords\n"
+         "Page size    = %d bytes, 2^%d us\n"
+         "Erase types  =",
+         len, page_size, page_time_bits);
+  for (i = 0; i < erase_type_count; i++)
+    printf(" %02x:2^%d", erase_types[i].opcode, erase_types[i].size_bits);
+  printf("\n");
+#endif
+
+  return 1;
+}
+
 unsigned char probe_qspi_flash(void) {
   spi_cs_high();
   usleep(50000L);
 
 #ifdef QSPI_VERBOSE
+  probe_screen();
   printf("\nProbing flash...\n");
 #endif
 
@@ -1539,16 +2526,18 @@ unsigned char probe_qspi_flash(void) {
   usleep(10000);
 
   fetch_rdid();
-  read_registers();
   while ((manufacturer == 0xff) && (device_id == 0xffff)) {
+    probe_screen();
     printf(
         "%cERROR: Cannot communicate with QSPI\nflash device. Retry...%c\n\n",
         28, 5);
 
     flash_reset();
     fetch_rdid();
-    read_registers();
   }
+  // read_registers needs to know if the part has CR1
+  flash_vendor = find_flash_vendor(manufacturer);
+  read_registers();
 
 #ifdef QSPI_DEBUG
   // hexdump info block
@@ -1565,76 +2554,104 @@ unsigned char probe_qspi_flash(void) {
   printf("\nQSPI Information\n\n");
 #endif
 
-  // this looks for ALT?\00 at cfi_data pos 0x51
-  if (cfi_data[0x51] == 0x41 && cfi_data[0x52] == 0x4c &&
-      cfi_data[0x53] == 0x54 && cfi_data[0x56] == 0x00) {
-    short i;
-    for (i = 0; i < cfi_data[0x57]; i++)
-      part[i] = cfi_data[0x58 + i];
-    part[i] = 0;
 #ifdef QSPI_VERBOSE
-    printf("Part         = %s\n"
-           "Part Family  = %02x-%c%c\n",
-           part, cfi_data[5], cfi_data[6], cfi_data[7]);
+  printf("Vendor       = %s\n", flash_vendor->name);
 #endif
-  } else {
-    part[0] = 0;
+
+  // only the Spansion parts have the CFI layout we know, for everything
+  // else, JEDEC SFDP tells us what we need
+  if (flash_vendor->flags & FLASH_VENDOR_CFI || !probe_sfdp()) {
+    // this looks for ALT?\00 at cfi_data pos 0x51
+    if (cfi_data[0x51] == 0x41 && cfi_data[0x52] == 0x4c &&
+        cfi_data[0x53] == 0x54 && cfi_data[0x56] == 0x00) {
+      short i;
+      for (i = 0; i < cfi_data[0x57]; i++)
+        part[i] = cfi_data[0x58 + i];
+      part[i] = 0;
 #ifdef QSPI_VERBOSE
-    printf("%cPart         = unknown %02x %02x %02x\n"
-           "Part Family  = unknown%c\n",
-           28, cfi_data[0x51], cfi_data[0x52], cfi_data[0x53], 5);
+      printf("Part         = %s\n"
+             "Part Family  = %02x-%c%c\n",
+             part, cfi_data[5], cfi_data[6], cfi_data[7]);
 #endif
-  }
+    } else {
+      part[0] = 0;
+#ifdef QSPI_VERBOSE
+      printf("%cPart         = unknown %02x %02x %02x\n"
+             "Part Family  = unknown%c\n",
+             28, cfi_data[0x51], cfi_data[0x52], cfi_data[0x53], 5);
+#endif
+    }
 
 #ifdef QSPI_VERBOSE
-  printf("Manufacturer = $%02x\n", manufacturer);
-  printf("Device ID    = $%04x\n", device_id);
-  printf("RDID count   = %d\n", cfi_length);
-  printf("Sector Arch  = ");
+    printf("Manufacturer = $%02x\n", manufacturer);
+    printf("Device ID    = $%04x\n", device_id);
+    printf("RDID count   = %d\n", cfi_length);
+    printf("Sector Arch  = ");
 #endif
 
-  if (cfi_data[4] == 0x00) {
+    if (cfi_data[4] == 0x00) {
 #ifdef QSPI_VERBOSE
-    printf("uniform 256kb\n");
+      printf("uniform 256kb\n");
 #endif
-    num_4k_sectors = 0;
-    flash_sector_bits = 18;
-  } else if (cfi_data[4] == 0x01) {
-    num_4k_sectors = 1 + cfi_data[0x2d];
-    flash_sector_bits = 16;
+      num_4k_sectors = 0;
+      flash_sector_bits = 18;
+    } else if (cfi_data[4] == 0x01) {
+      num_4k_sectors = 1 + cfi_data[0x2d];
+      flash_sector_bits = 16;
 #ifdef QSPI_VERBOSE
-    printf("%dx4kb param/64kb data\n", num_4k_sectors);
+      printf("%dx4kb param/64kb data\n", num_4k_sectors);
 #endif
-  } else {
+    } else {
 #ifdef QSPI_VERBOSE
-    printf("%cunknown ($%02x)%c\n", 28, cfi_data[4], 5);
+      printf("%cunknown ($%02x)%c\n", 28, cfi_data[4], 5);
 #endif
-    flash_sector_bits = 0;
-  }
+      flash_sector_bits = 0;
+    }
+
+    // erase types, smallest first. CFI only has the typical time for the
+    // large sectors, 4k parameter sectors take about a quarter of that.
+    // Large sectors are erased by the $D680 engine, so only their time is
+    // used, for planning.
+    erase_type_count = 0;
+    if (num_4k_sectors) {
+      erase_types[0].size_bits = 12;
+      erase_types[0].opcode = 0x21;
+      erase_types[0].time_ms = (1U << cfi_data[0x21]) >> 2;
+      erase_type_count++;
+    }
+    erase_types[erase_type_count].size_bits = flash_sector_bits;
+    erase_types[erase_type_count].opcode = 0;
+    erase_types[erase_type_count].time_ms = 1U << cfi_data[0x21];
+    erase_type_count++;
+
 #ifdef QSPI_VERBOSE
-  printf("Prgtime      = 2^%d us\n"
-         "Page size    = 2^%d bytes\n",
-         cfi_data[0x20], cfi_data[0x2a]);
+    printf("Prgtime      = 2^%d us\n"
+           "Page size    = 2^%d bytes\n",
+           cfi_data[0x20], cfi_data[0x2a]);
 #endif
 
-  if (cfi_data[0x2a] == 8)
-    page_size = 256;
-  if (cfi_data[0x2a] == 9)
-    page_size = 512;
-  if (!page_size) {
-    printf("%cWARNING: Unsupported page size%c\n", 28, 5);
-    page_size = 0;
-  }
+    if (cfi_data[0x2a] == 8)
+      page_size = 256;
+    if (cfi_data[0x2a] == 9)
+      page_size = 512;
+    if (!page_size) {
+      probe_screen();
+      printf("%cWARNING: Unsupported page size%c\n", 28, 5);
+      page_size = 0;
+    }
 #ifdef QSPI_VERBOSE
-  printf("Est. prgtime = %d us/byte.\n", cfi_data[0x20] / cfi_data[0x2a]);
-  printf("Est. erasetm = 2^%d ms/sector.\n", cfi_data[0x21]);
+    printf("Est. prgtime = %d us/byte.\n", cfi_data[0x20] / cfi_data[0x2a]);
+    printf("Est. erasetm = 2^%d ms/sector.\n", cfi_data[0x21]);
 #endif
+    flash_size_bits = cfi_data[0x27];
+    page_time_bits = cfi_data[0x20];
+  }
 
   unsigned short mb = 1;
 
   // Work out size of flash in MB
   {
-    unsigned char n = cfi_data[0x27];
+    unsigned char n = flash_size_bits;
     mb = 1;
     n -= 20;
     while (n) {
@@ -1645,8 +2662,10 @@ unsigned char probe_qspi_flash(void) {
 
   slot_count = mb / SLOT_MB;
   // sanity check for slot count
-  if (slot_count == 0 || slot_count > 8)
+  if (slot_count == 0)
     slot_count = 8;
+  if (slot_count > MAX_SLOTS)
+    slot_count = MAX_SLOTS;
 
   // latency_code=3;
   latency_code = reg_cr1 >> 6;
@@ -1675,6 +2694,7 @@ unsigned char probe_qspi_flash(void) {
 
   // failed to detect, probably dip sw #3 = off
   if (mb == 0 || page_size == 0 || flash_sector_bits == 0 || part[0] == 0) {
+    probe_screen();
     printf("\n%cERROR: Failed to probe flash\n       (dip #3 not on?)%c\n", 28,
            5);
 #ifndef STANDALONE
@@ -1691,60 +2711,85 @@ unsigned char probe_qspi_flash(void) {
 
   /* The 64MB = 512Mbit flash in the MEGA65 R3A comes write-protected, and with
      quad-SPI mode disabled. So we have to fix both of those (which then
-     persists), and then flash the bitstream.
+     persists), and then flash the bitstream. CR1 is non-volatile, so only
+     write it when it is not set up already.
   */
-  enable_quad_mode();
-
-  read_registers();
+  {
+    unsigned char old_sr1 = reg_sr1, old_cr1 = reg_cr1;
+
+    if (enable_quad_mode()) {
+      read_registers();
+      latency_code = reg_cr1 >> 6;
+      probe_screen();
+      printf("\nSR1 $%02x -> $%02x, CR1 $%02x -> $%02x\n", old_sr1, reg_sr1,
+             old_cr1, reg_cr1);
+    }
+  }
 
-  if (reg_sr1 & 0x80) {
+  // the engine and the SR1 bits used for erase and program are Spansion's
+  flash_read_only = !(flash_vendor->flags & FLASH_VENDOR_CFI);
+  if (flash_read_only) {
+    probe_screen();
+    printf("\n%cWARNING: %s flash is read-only%c\n", 28, part, 5);
+  } else if (reg_sr1 & 0x80) {
+    probe_screen();
     printf("\n%cERROR: Could not clear whole-of-flash write-protect flag.%c\n",
            28, 5);
     while (1)
       POKE(0xD020, PEEK(0xD020) + 1);
   }
 
+#ifdef STANDALONE
+  // the core megaflash probes before it has set up the screen
   printf("\nQuad-mode enabled,\nflash is write-enabled.\n\n");
+#endif
 
   // Finally make sure that there is no half-finished QSPI commands that will
   // cause erroneous reads of sectors.
-  read_data(0);
-  read_data(0);
-  read_data(0);
+  qspi_calibrate();
 
+#ifdef STANDALONE
   printf("Done probing flash.\n\n");
+#endif
 
   return 0;
 }
 
-void enable_quad_mode(void) {
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x06); // WREN
-  spi_cs_high();
-  delay();
+/*
+ * uchar quad_mode_ok(void)
+ *
+ * checks reg_sr1 and reg_cr1 for quad mode, our latency code and no block
+ * or SRWD protection, which is what enable_quad_mode would write. Only
+ * known for Spansion parts.
+ */
+unsigned char quad_mode_ok(void) {
+  return flash_vendor->flags & FLASH_VENDOR_CFI && (reg_cr1 & 0xc2) == 0x42 &&
+         !(reg_sr1 & 0x9c);
+}
 
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x01);
-  spi_tx_byte(0x00);
+/*
+ * uchar enable_quad_mode(void)
+ *
+ * enables quad mode and removes the block protection, unless the flash
+ * is set up like that already, or is not a Spansion part
+ *
+ * returns 1 if the registers were written
+ */
+unsigned char enable_quad_mode(void) {
+  read_registers();
+  if (quad_mode_ok() || !(flash_vendor->flags & FLASH_VENDOR_CFI))
+    return 0;
+
+  spi_command(&spi_cmd_wren, 0);
+
+  spi_cmd_data[0] = 0x00;
   // Latency code = 01, quad mode=1
-  spi_tx_byte(0x42);
-  spi_cs_high();
-  delay();
+  spi_cmd_data[1] = 0x42;
+  spi_command(&spi_cmd_wrr, 0);
 
   // Wait for busy flag to clear
   // This can take ~200ms according to the data sheet!
-  reg_sr1 = 0x01;
-  while (reg_sr1 & 0x01) {
-    read_sr1();
-  }
+  sr1_wait(0x01);
 
 #if 0
   spi_cs_high();
@@ -1759,125 +2804,90 @@ void enable_quad_mode(void) {
   printf("CR1=$%02x\n",c);
   press_any_key(0, 0);
 #endif
+
+  return 1;
 }
 
 void unprotect_flash(unsigned long addr) {
-  unsigned char c;
-
   //  printf("unprotecting sector.\n");
 
-  short i = addr >> flash_sector_bits;
+  // start of the large sector, the DYB bits are per sector
+  addr &= ~((1L << flash_sector_bits) - 1);
 
-  c = 0;
-  while (c != 0xff) {
+  spi_cmd_data[0] = 0;
+  while (spi_cmd_data[0] != 0xff) {
 
     // Wait for busy flag to clear
-    reg_sr1 = 0x03;
-    while (reg_sr1 & 0x03) {
-      read_sr1();
-    }
+    sr1_wait(0x03);
 
     spi_write_enable();
 
-    spi_cs_high();
-    spi_clock_high();
-    delay();
-    spi_cs_low();
-    delay();
-    spi_tx_byte(0xe1);
-    spi_tx_byte(i >> 6);
-    spi_tx_byte(i << 2);
-    spi_tx_byte(0);
-    spi_tx_byte(0);
-
-    spi_tx_byte(0xff);
-    spi_clock_low();
-
-    spi_cs_high();
-    delay();
+    spi_cmd_data[0] = 0xff;
+    spi_command(&spi_cmd_dybwr, addr);
 
     // Wait for busy flag to clear
-    reg_sr1 = 0x03;
-    while (reg_sr1 & 0x03) {
-      read_sr1();
-    }
+    sr1_wait(0x03);
 
-    spi_cs_high();
-    spi_clock_high();
-    delay();
-    spi_cs_low();
-    delay();
-    spi_tx_byte(0xe0);
-    spi_tx_byte(i >> 6);
-    spi_tx_byte(i << 2);
-    spi_tx_byte(0);
-    spi_tx_byte(0);
-    c = spi_rx_byte();
-
-    spi_cs_high();
-    delay();
+    spi_command(&spi_cmd_dybrd, addr);
   }
   //   printf("done unprotecting.\n");
 }
 
 void query_flash_protection(unsigned long addr) {
-  unsigned long address_in_sector = 0;
-  unsigned char c;
-
-  short i = addr >> flash_sector_bits;
+  addr &= ~((1L << flash_sector_bits) - 1);
 
-  printf("DYB Protection flag: ");
-
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0xe0);
-  spi_tx_byte(i >> 6);
-  spi_tx_byte(i << 2);
-  spi_tx_byte(0);
-  spi_tx_byte(0);
-  c = spi_rx_byte();
-  printf("$%02x ", c);
+  spi_command(&spi_cmd_dybrd, addr);
+  printf("DYB Protection flag: $%02x \n", spi_cmd_data[0]);
 
-  spi_cs_high();
-  delay();
-  printf("\n");
+  spi_command(&spi_cmd_ppbrd, addr);
+  printf("PPB Protection flags: $%02x \n", spi_cmd_data[0]);
+}
 
-  printf("PPB Protection flags: ");
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0xe2);
-  spi_tx_byte(i >> 6);
-  spi_tx_byte(i << 2);
-  spi_tx_byte(0);
-  spi_tx_byte(0);
-  c = spi_rx_byte();
-  printf("$%02x ", c);
+/*
+ * uchar erase_span_wide(span_addr)
+ *
+ * checks if erasing the 4k parameter sectors of a large sector one by one
+ * takes longer than a single large erase
+ *
+ * returns 1 if a large erase is cheaper
+ */
+unsigned char erase_span_wide(unsigned long span_addr) {
+  unsigned long span_end = span_addr + (1L << flash_sector_bits);
+  unsigned long small_ms = 0;
 
-  spi_cs_high();
-  delay();
-  printf("\n");
+  for (; span_addr < span_end; span_addr += 4096)
+    if (!flash_region_blank(span_addr, 4096))
+      small_ms += find_erase_type(12)->time_ms;
+  return small_ms > find_erase_type(flash_sector_bits)->time_ms;
 }
 
 void erase_some_sectors(unsigned long end_addr, unsigned char progress) {
   unsigned long size;
+  unsigned char size_bits;
 
   while (addr < end_addr) {
-    if (addr < (unsigned long)num_4k_sectors << 12)
-      size = 4096;
-    else
-      size = 1L << ((long)flash_sector_bits);
-
-    printf("%c    Erasing sector at $%08lX", 0x13, addr);
-    POKE(0xD020, 2);
-    erase_sector(addr);
-    read_data(0xffffffff);
-    POKE(0xD020, 0);
+    size_bits = flash_sector_bits;
+    if (addr < (unsigned long)num_4k_sectors << 12) {
+      size_bits = 12;
+      // parameter sectors filling a whole large sector might be faster
+      // erased in one go
+      if (!(addr & ((1L << flash_sector_bits) - 1)) &&
+          addr + (1L << flash_sector_bits) <= end_addr &&
+          erase_span_wide(addr))
+        size_bits = flash_sector_bits;
+    }
+    size = 1L << size_bits;
+
+    // no need to unprotect, erase and wait for sectors that are already empty
+    if (flash_region_blank(addr, size))
+      printf("%c   Skipping sector at $%08lX", 0x13, addr);
+    else {
+      printf("%c    Erasing sector at $%08lX", 0x13, addr);
+      POKE(0xD020, 2);
+      erase_sector_bits(addr, size_bits);
+      read_data_in_place(0xffffffff);
+      POKE(0xD020, 0);
+    }
 
     addr += size;
     if (progress)
@@ -1886,7 +2896,19 @@ void erase_some_sectors(unsigned long end_addr, unsigned char progress) {
 }
 
 void erase_sector(unsigned long address_in_sector) {
+  erase_sector_bits(address_in_sector,
+                    address_in_sector < (unsigned long)num_4k_sectors << 12
+                        ? 12
+                        : flash_sector_bits);
+}
 
+/*
+ * erase_sector_bits(address_in_sector, size_bits)
+ *
+ * erases the 4k (size_bits 12) or large sector at the address
+ */
+void erase_sector_bits(unsigned long address_in_sector,
+                       unsigned char size_bits) {
   unprotect_flash(address_in_sector);
   //  query_flash_protection(address_in_sector);
 
@@ -1897,26 +2919,19 @@ void erase_sector(unsigned long address_in_sector) {
   // XXX Clear status register (0x30)
   //  printf("clearing status register...\n");
   while (reg_sr1 & 0x61) {
-    spi_cs_high();
-    spi_clock_high();
-    delay();
-    spi_cs_low();
-    delay();
-    spi_tx_byte(0x30);
-    spi_cs_high();
-
+    spi_command(&spi_cmd_clsr, 0);
     read_sr1();
   }
 
   // XXX Erase 64/256kb (0xdc ?)
   // XXX Erase 4kb sector (0x21 ?)
   //  printf("erasing sector...\n");
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  if ((addr >> 12) >= num_4k_sectors) {
+  if (size_bits > 12) {
+    spi_cs_high();
+    spi_clock_high();
+    delay();
+    spi_cs_low();
+    delay();
     // Do 64KB/256KB sector erase
     //    printf("erasing large sector.\n");
     POKE(0xD681, address_in_sector >> 0);
@@ -1928,11 +2943,10 @@ void erase_sector(unsigned long address_in_sector) {
   } else {
     // Do fast 4KB sector erase
     //    printf("erasing small sector.\n");
-    spi_tx_byte(0x21);
-    spi_tx_byte(address_in_sector >> 24);
-    spi_tx_byte(address_in_sector >> 16);
-    spi_tx_byte(address_in_sector >> 8);
-    spi_tx_byte(address_in_sector >> 0);
+    spi_cmd_type erase = {0, 0, 0, 0, 0, 0};
+    erase.opcode = find_erase_type(size_bits)->opcode;
+    erase.addr_bytes = flash_addr_bytes;
+    spi_command(&erase, address_in_sector);
   }
 
   // CLK must be set low before releasing CS according
@@ -1949,10 +2963,9 @@ void erase_sector(unsigned long address_in_sector) {
       continue;
   }
 
-  reg_sr1 = 0x03;
-  while (reg_sr1 & 0x03) {
-    read_registers();
-  }
+  sr1_wait(0x03);
+  if (reg_sr1 & 0x20)
+    tele_sector.eraerr++;
 
 #ifndef QSPI_VERBOSE
   if (reg_sr1 & 0x20) {
@@ -1966,6 +2979,85 @@ void erase_sector(unsigned long address_in_sector) {
 #endif /* QSPI_VERBOSE */
 }
 
+#define QSPI_WARMUP_MAX 32
+
+/*
+ * uchar qspi_warmup(void)
+ *
+ * The first $D680 reads after the bitbashed probe can return rubbish
+ * (all $EE): the engine starts while CS and the clock are still in the
+ * state the bitbash code left them in. Hand the lines back to the
+ * engine, then read sector 0 until it is no longer $EE and matches the
+ * bitbashed reference in data_buffer. Done once by qspi_calibrate.
+ *
+ * returns the number of reads it took, 0 if it never settled
+ */
+unsigned char qspi_warmup(void) {
+  unsigned char reads;
+#ifdef QSPI_VERBOSE
+  unsigned char frame = PEEK(FRAMECOUNT);
+#endif
+
+  POKE(BITBASH_PORT, 0xff);
+  POKE(CLOCKCTL_PORT, 0x02);
+  for (reads = 1; reads <= QSPI_WARMUP_MAX; reads++) {
+    read_data_to(0, (unsigned long)buffer, 512);
+    if (buffer[0] != 0xee && !memcmp(buffer, data_buffer, 512))
+      break;
+  }
+  if (reads > QSPI_WARMUP_MAX)
+    reads = 0;
+
+#ifdef QSPI_VERBOSE
+  printf("Warm-up      = %d reads, %d frames\n", reads,
+         (unsigned char)(PEEK(FRAMECOUNT) - frame));
+#endif
+
+  return reads;
+}
+
+#define QSPI_WAIT_STEP 20
+
+/*
+ * qspi_calibrate(void)
+ *
+ * finds the shortest wait after a $D680 read that still gets all of
+ * sector 0, compared with a bitbashed read, and keeps one step of margin.
+ * The result is used for the rest of the session. Warms up the engine
+ * after the bitbashed read, and keeps the default wait if that fails.
+ */
+void qspi_calibrate(void) {
+  unsigned char wait, pass;
+  unsigned short i;
+
+  bash_read_data(0, data_buffer);
+  if (!qspi_warmup()) {
+    probe_screen();
+    printf("%cWARNING: QSPI reads did not settle%c\n", 28, 5);
+    return;
+  }
+  for (wait = qspi_read_wait - QSPI_WAIT_STEP; wait >= QSPI_WAIT_STEP;
+       wait -= QSPI_WAIT_STEP) {
+    qspi_read_wait = wait;
+    for (pass = 0; pass < 4; pass++) {
+      // an incomplete read leaves some of the complement behind
+      for (i = 0; i < 512; i++)
+        buffer[i] = ~data_buffer[i];
+      lcopy((unsigned long)buffer, 0xffd6e00L, 512);
+      read_data_to(0, (unsigned long)buffer, 512);
+      if (memcmp(buffer, data_buffer, 512))
+        break;
+    }
+    if (pass < 4)
+      break;
+  }
+  qspi_read_wait = wait + 2 * QSPI_WAIT_STEP;
+
+#ifdef QSPI_VERBOSE
+  printf("Read wait    = %d\n", qspi_read_wait);
+#endif
+}
+
 unsigned char verify_data_in_place(unsigned long start_address) {
   unsigned char b;
   POKE(0xd020, 1);
@@ -1977,7 +3069,7 @@ unsigned char verify_data_in_place(unsigned long start_address) {
   POKE(0xD680, 0x56); // QSPI Flash Sector verify command
   // XXX For some reason the busy flag is broken here.
   // So just wait a little while, but only a little while
-  for (b = 0; b < 180; b++)
+  for (b = 0; b < qspi_read_wait; b++)
     continue;
   POKE(0xd020, 0);
 
@@ -1995,7 +3087,35 @@ unsigned char verify_data(unsigned long start_address) {
   return verify_data_in_place(start_address);
 }
 
-void program_page(unsigned long start_address, unsigned int page_size) {
+unsigned char program_page(unsigned long start_address,
+                           unsigned int page_size) {
+  return program_page_from((unsigned long)data_buffer, start_address,
+                           page_size, 0);
+}
+
+// source address of the page that is already in the QSPI write buffer
+unsigned long program_staged = 0;
+
+// tries to program a page before giving up on it
+#define PROGRAM_PAGE_PASSES 4
+
+/*
+ * program_page_from(src, start_address, page_size, next_src)
+ *
+ * programs a page from any 28 bit address (e.g. attic RAM) directly,
+ * without going through data_buffer.
+ *
+ * If next_src is not 0, the next page is copied into the write buffer
+ * while the flash is busy programming this one. Calling this again with
+ * src == next_src then skips the copy. Nothing else may use the QSPI
+ * buffer between those two calls.
+ *
+ * returns 0 on success, 1 if the flash still reports a program error
+ * after PROGRAM_PAGE_PASSES tries
+ */
+unsigned char program_page_from(unsigned long src, unsigned long start_address,
+                                unsigned int page_size,
+                                unsigned long next_src) {
   unsigned char b, pass = 0;
   unsigned char errs = 0;
 
@@ -2020,13 +3140,7 @@ top:
   // XXX Clear status register (0x30)
   //  printf("clearing status register...\n");
   while (reg_sr1 & 0x61) {
-    spi_cs_high();
-    spi_clock_high();
-    delay();
-    spi_cs_low();
-    delay();
-    spi_tx_byte(0x30);
-    spi_cs_high();
+    spi_command(&spi_cmd_clsr, 0);
 
     // We have to read registers here to clear error flags?
     // i.e. not just read SR1?
@@ -2049,7 +3163,8 @@ top:
   if (page_size == 256) {
     // Write 256 bytes
     //    printf("256 byte program\n");
-    lcopy((unsigned long)data_buffer, 0xffd6f00L, 256);
+    if (program_staged != src)
+      lcopy(src, 0xffd6f00L, 256);
 
     POKE(0xD681, start_address >> 0);
     POKE(0xD682, start_address >> 8);
@@ -2065,7 +3180,7 @@ top:
     //    printf("Hardware SPI write 512 (a)\n");
 
     // is this broken? at least it is not used
-    lcopy((unsigned long)data_buffer, 0xffd6e00L, 512);
+    lcopy(src, 0xffd6e00L, 512);
     POKE(0xD681, start_address >> 0);
     POKE(0xD682, start_address >> 8);
     POKE(0xD683, start_address >> 16);
@@ -2082,9 +3197,20 @@ top:
   }
 
   // XXX For some reason the busy flag is broken here.
-  // So just wait a little while, but only a little while
+  // So just wait a little while, but only a little while. Not the
+  // calibrated read wait: the next page is staged right after this.
   for (b = 0; b < 180; b++)
     continue;
+  if (flash_caution >= FLASH_CAUTION_SETTLE)
+    usleep(1000);
+
+  // The page has been sent, so the buffer is free while the flash is busy.
+  // After a write error, the page is copied again from src.
+  program_staged = 0;
+  if (next_src && page_size == 256) {
+    lcopy(next_src, 0xffd6f00L, 256);
+    program_staged = next_src;
+  }
 
   //  press_any_key(0, 0);
 
@@ -2097,6 +3223,7 @@ top:
   reg_sr1 = 0x01;
   while (reg_sr1 & 0x01) {
     if (reg_sr1 & 0x40) {
+      tele_sector.prgerr++;
       if (verboseProgram || pass > 2) {
         printf("%c%c%cwrite error occurred @$%08lx\n", 0x13, 0x11, 152,
                start_address);
@@ -2106,7 +3233,17 @@ top:
                pass, 5);
         //      press_any_key(0, 0);
       }
-      goto top;
+      flash_caution_raise(pass > 1 ? FLASH_CAUTION_SETTLE
+                                   : FLASH_CAUTION_VERIFY);
+      if (pass < PROGRAM_PAGE_PASSES)
+        goto top;
+      // the page is left to an erase of the sector. P_ERR keeps WIP set
+      // until it is cleared, the unprotect before that erase would wait
+      // for it forever
+      program_staged = 0;
+      spi_clear_sr1();
+      read_registers();
+      return 1;
     }
     read_registers();
   }
@@ -2121,9 +3258,33 @@ top:
     printf("data at $%08llx written.\n", start_address);
 #endif /* QSPI_DEBUG */
 #endif /* QSPI_VERBOSE */
+
+  return 0;
 }
 
 void read_data(unsigned long start_address) {
+  read_data_to(start_address, (unsigned long)data_buffer, 512);
+}
+
+/*
+ * read_data_to(start_address, dest, len)
+ *
+ * reads 512 bytes from flash and copies the first len bytes to any
+ * 28 bit address dest (chip RAM, attic RAM, screen, ...).
+ */
+void read_data_to(unsigned long start_address, unsigned long dest,
+                  unsigned int len) {
+  read_data_in_place(start_address);
+  lcopy(0xFFD6E00L, dest, len);
+}
+
+/*
+ * read_data_in_place(start_address)
+ *
+ * reads 512 bytes from flash into the QSPI buffer at $FFD6E00 and
+ * leaves them there. Also used as dummy read.
+ */
+void read_data_in_place(unsigned long start_address) {
   unsigned char b;
 
   // Full hardware-acceleration of reading, which is both faster
@@ -2137,17 +3298,83 @@ void read_data(unsigned long start_address) {
   POKE(0xD680, 0x53); // QSPI Flash Sector read command
   // XXX For some reason the busy flag is broken here.
   // So just wait a little while, but only a little while
-  for (b = 0; b < 180; b++)
+  for (b = 0; b < qspi_read_wait; b++)
     continue;
 
   // Tristate and release CS at the end
   POKE(BITBASH_PORT, 0xff);
 
-  lcopy(0xFFD6E00L, (unsigned long)data_buffer, 512);
-
   POKE(0xD020, 0);
 }
 
+/*
+  Sequential reads
+
+  The $D680 engine always sends opcode, address and dummy cycles, so
+  there is no continuous read mode we could use. What a stream saves is
+  setting up all four address registers for every 512 bytes: only the
+  bytes that change are written. Open at a 512 byte boundary.
+*/
+unsigned long stream_addr;
+
+void qspi_stream_open(unsigned long addr) {
+  stream_addr = addr;
+  POKE(0xD681, addr >> 0);
+  POKE(0xD682, addr >> 8);
+  POKE(0xD683, addr >> 16);
+  POKE(0xD684, addr >> 24);
+}
+
+/*
+ * qspi_stream_command(command)
+ *
+ * runs the engine read or verify command on the block at the cursor and
+ * moves the cursor to the next block
+ */
+void qspi_stream_command(unsigned char command) {
+  unsigned char b;
+
+  POKE(0xD680, 0x5f); // Set number of dummy cycles
+  POKE(0xD680, command);
+  for (b = 0; b < qspi_read_wait; b++)
+    continue;
+
+  stream_addr += 512;
+  POKE(0xD682, stream_addr >> 8);
+  if (!(unsigned short)stream_addr) {
+    POKE(0xD683, stream_addr >> 16);
+    POKE(0xD684, stream_addr >> 24);
+  }
+}
+
+/*
+ * qspi_stream_next512(dest)
+ *
+ * reads the next 512 bytes and copies them to dest, unless it is 0
+ */
+void qspi_stream_next512(unsigned long dest) {
+  qspi_stream_command(0x53);
+  if (dest)
+    lcopy(0xFFD6E00L, dest, 512);
+}
+
+/*
+ * uchar qspi_stream_verify512(void)
+ *
+ * compares the next 512 bytes with the QSPI buffer
+ *
+ * returns 1 if they are the same
+ */
+unsigned char qspi_stream_verify512(void) {
+  qspi_stream_command(0x56);
+  return !(PEEK(0xD689) & 0x40);
+}
+
+void qspi_stream_close(void) {
+  // Tristate and release CS at the end
+  POKE(BITBASH_PORT, 0xff);
+}
+
 void fetch_rdid(void) {
   /* Run command 0x9F and fetch CFI etc data.
      (Section 9.2.2)
@@ -2199,68 +3426,47 @@ void fetch_rdid(void) {
 }
 
 void read_registers(void) {
-
   // Status Register 1 (SR1)
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x05);
-  reg_sr1 = spi_rx_byte();
-  spi_cs_high();
-  delay();
+  spi_command(&spi_cmd_rdsr1, 0);
+  reg_sr1 = spi_cmd_data[0];
 
-  // Config Register 1 (CR1)
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x35);
-  reg_cr1 = spi_rx_byte();
-  spi_cs_high();
-  delay();
+  // Config Register 1 (CR1), 0x35 is EQIO/QPIEN on other parts
+  if (!(flash_vendor->flags & FLASH_VENDOR_CFI))
+    return;
+  spi_command(&spi_cmd_rdcr1, 0);
+  reg_cr1 = spi_cmd_data[0];
 }
 
 void read_sr1(void) {
   // Status Register 1 (SR1)
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x05);
-  reg_sr1 = spi_rx_byte();
-  spi_cs_high();
-  delay();
+  spi_command(&spi_cmd_rdsr1, 0);
+  reg_sr1 = spi_cmd_data[0];
+}
+
+/*
+ * sr1_wait(mask)
+ *
+ * polls SR1 until none of the bits in mask are set
+ */
+void sr1_wait(unsigned char mask) {
+  if (flash_caution < FLASH_CAUTION_SETTLE) {
+    reg_sr1 = bash_sr1_wait(mask);
+    return;
+  }
+  reg_sr1 = mask;
+  while (reg_sr1 & mask)
+    read_sr1();
 }
 
 void read_ppbl(void) {
   // PPB Lock Register
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0xa7);
-  spi_cs_high();
-  delay();
+  spi_command(&spi_cmd_ppblrd, 0);
+  reg_ppbl = spi_cmd_data[0];
 }
 
 void read_ppb_for_sector(unsigned long sector_start) {
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0xe2);
-  spi_tx_byte(sector_start >> 24);
-  spi_tx_byte(sector_start >> 16);
-  spi_tx_byte(sector_start >> 8);
-  spi_tx_byte(sector_start >> 0);
-  spi_cs_high();
-  delay();
+  spi_command(&spi_cmd_ppbrd, sector_start);
+  reg_ppb = spi_cmd_data[0];
 }
 
 void spi_write_enable(void) {
@@ -2272,28 +3478,10 @@ void spi_write_enable(void) {
 }
 
 void spi_write_disable(void) {
-  spi_cs_high();
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0x04);
-  spi_cs_high();
-  delay();
-
-  read_sr1();
-  while (reg_sr1 & 0x02) {
-    spi_cs_high();
-    spi_clock_high();
-    delay();
-    spi_cs_low();
-    delay();
-    spi_tx_byte(0x04);
-    spi_cs_high();
-    delay();
-
+  do {
+    spi_command(&spi_cmd_wrdi, 0);
     read_sr1();
-  }
+  } while (reg_sr1 & 0x02);
 }
 
 void spi_clear_sr1(void) {
@@ -2315,14 +3503,14 @@ void spi_clear_sr1(void) {
 // TODO: replace this with a macro that calls usleep instead or does nothing
 void delay(void) {
   // Slow down signalling when debugging using JTAG monitoring.
-  // Not needed for normal operation.
+  // Not needed for normal operation, only for flash showing write errors.
+  if (flash_caution >= FLASH_CAUTION_SETTLE)
+    usleep(2);
 
   // unsigned int di;
   //   for(di=0;di<1000;di++) continue;
 }
 
-unsigned char bash_bits = 0xFF;
-
 void spi_tristate_si(void) {
   POKE(BITBASH_PORT, 0x8f);
   bash_bits |= 0x8f;
@@ -2411,33 +3599,8 @@ void qspi_tx_nybl(unsigned char nybl) {
 }
 
 void spi_tx_byte(unsigned char b) {
-  unsigned char i;
-
-  // Disable tri-state of QSPIDB lines
-  bash_bits |= (0x1F - 0x01);
-  bash_bits &= 0x7f;
-  POKE(BITBASH_PORT, bash_bits);
-
-  for (i = 0; i < 8; i++) {
-
-    //    spi_tx_bit(b&0x80);
-
-    // spi_clock_low();
-    POKE(CLOCKCTL_PORT, 0x00);
-    //    bash_bits&=(0x7f-0x20);
-    //    POKE(BITBASH_PORT,bash_bits);
-
-    // spi_so_set(b&80);
-    if (b & 0x80)
-      POKE(BITBASH_PORT, 0x0f);
-    else
-      POKE(BITBASH_PORT, 0x0e);
-
-    // spi_clock_high();
-    POKE(CLOCKCTL_PORT, 0x02);
-
-    b = b << 1;
-  }
+  // unrolled in qspibitbash.s
+  bash_tx_byte(b);
 }
 
 void qspi_tx_byte(unsigned char b) {
@@ -2466,6 +3629,10 @@ unsigned char spi_rx_byte(void) {
   unsigned char b = 0;
   unsigned char i;
 
+  // the unrolled version in qspibitbash.s has no delay between clock edges
+  if (flash_caution < FLASH_CAUTION_SETTLE)
+    return bash_rx_byte();
+
   b = 0;
 
   //  spi_tristate_si();
@@ -2487,6 +3654,86 @@ unsigned char spi_rx_byte(void) {
   return b;
 }
 
+unsigned char spi_cmd_data[SPI_CMD_DATA_MAX];
+
+/*
+ * spi_command(cmd, address)
+ *
+ * runs the command described by cmd: opcode, address (if any), dummy
+ * clocks, then sends and receives data through spi_cmd_data. Simple
+ * commands go through the assembly command+read sequence.
+ */
+void spi_command(const spi_cmd_type *cmd, unsigned long address) {
+  unsigned char i;
+
+  DEBUG_SPI_CMD(cmd, address);
+
+  if (!cmd->addr_bytes && !cmd->dummy_clocks && !cmd->tx_len &&
+      !cmd->flags && flash_caution < FLASH_CAUTION_SETTLE) {
+    bash_cmd_read(cmd->opcode, cmd->rx_len, spi_cmd_data);
+    return;
+  }
+
+  spi_cs_high();
+  spi_clock_high();
+  delay();
+  spi_cs_low();
+  delay();
+  spi_tx_byte(cmd->opcode);
+  for (i = cmd->addr_bytes; i; i--)
+    spi_tx_byte(address >> ((i - 1) << 3));
+  spi_idle_clocks(cmd->dummy_clocks);
+
+  for (i = 0; i < cmd->tx_len; i++)
+    if (cmd->flags & SPI_CMD_QUAD)
+      qspi_tx_byte(spi_cmd_data[i]);
+    else
+      spi_tx_byte(spi_cmd_data[i]);
+  for (i = 0; i < cmd->rx_len; i++)
+    if (cmd->flags & SPI_CMD_QUAD)
+      spi_cmd_data[i] = qspi_rx_byte();
+    else
+      spi_cmd_data[i] = spi_rx_byte();
+
+  if (cmd->flags & SPI_CMD_OPEN)
+    return;
+  if (cmd->flags & SPI_CMD_CLOCK_LOW)
+    spi_clock_low();
+  spi_cs_high();
+  delay();
+}
+
+/*
+ * spi_opcode(opcode)
+ *
+ * sends a command that consists of just the opcode
+ */
+void spi_opcode(unsigned char opcode) {
+  spi_cmd_type cmd = {0, 0, 0, 0, 0, 0};
+  cmd.opcode = opcode;
+  spi_command(&cmd, 0);
+}
+
+/*
+ * bash_read_data(start_address, dest)
+ *
+ * reads 512 bytes from flash into dest without the $D680 engine, with
+ * the READ command for the address width of the part
+ */
+void bash_read_data(unsigned long start_address, unsigned char *dest) {
+  spi_cmd_type read = {0x13, 4, 0, 0, 0, SPI_CMD_OPEN};
+  unsigned short i;
+
+  if (flash_addr_bytes == 3) {
+    read.opcode = 0x03;
+    read.addr_bytes = 3;
+  }
+  spi_command(&read, start_address);
+  for (i = 0; i < 512; i++)
+    dest[i] = spi_rx_byte();
+  spi_cs_high();
+}
+
 void flash_reset(void) {
   unsigned char i;
 
@@ -2501,11 +3748,6 @@ void flash_reset(void) {
     delay();
   }
 
-  spi_clock_high();
-  delay();
-  spi_cs_low();
-  delay();
-  spi_tx_byte(0xf0);
-  spi_cs_high();
+  spi_command(&spi_cmd_reset, 0);
   usleep(10000);
 }
@@ -69,20 +69,30 @@ typedef struct {
 
 extern models_type mega_models[];
 
+// 128MB of flash with 8MB slots, or 64MB with 4MB slots
+#define MAX_SLOTS 16
+
+typedef struct {
+  unsigned char id;
+  unsigned char flags;
+  char *name;
+} flash_vendor_type;
+
 extern uint8_t hw_model_id;
 extern char *hw_model_name;
 extern unsigned char slot_count;
+extern unsigned char copy_source_slot;
 
 extern struct m65_tm tm_start;
 extern struct m65_tm tm_now;
 
-extern unsigned char bash_bits;
 extern unsigned int page_size;
 extern unsigned char latency_code;
 extern unsigned char reg_cr1;
 extern unsigned char reg_sr1;
 extern unsigned char reg_ppbl;
 extern unsigned char reg_ppb;
+extern unsigned char flash_read_only;
 
 extern unsigned char verboseProgram;
 
@@ -118,14 +128,37 @@ void query_flash_protection(unsigned long addr_in_sector);
 void fetch_rdid(void);
 void flash_reset(void);
 unsigned char check_input(char *m, uint8_t case_sensitive);
+void menu_screen(void);
 void unprotect_flash(unsigned long addr_in_sector);
 unsigned char verify_data_in_place(unsigned long start_address);
+unsigned char verify_data(unsigned long start_address);
+unsigned char qspi_warmup(void);
+void qspi_calibrate(void);
+void bash_read_data(unsigned long start_address, unsigned char *dest);
+unsigned long flash_first_nonblank(unsigned long flash_addr,
+                                   unsigned long size);
+#define flash_region_blank(ADDR, SIZE)                                         \
+  (flash_first_nonblank(ADDR, SIZE) == FLASH_BLANK)
 void progress_bar(unsigned int add_pages, char *action);
 void read_data(unsigned long start_address);
-void program_page(unsigned long start_address, unsigned int page_size);
+void read_data_to(unsigned long start_address, unsigned long dest,
+                  unsigned int len);
+void read_data_in_place(unsigned long start_address);
+void qspi_stream_open(unsigned long addr);
+void qspi_stream_next512(unsigned long dest);
+unsigned char qspi_stream_verify512(void);
+void qspi_stream_close(void);
+unsigned char program_page(unsigned long start_address,
+                           unsigned int page_size);
+unsigned char program_page_from(unsigned long src, unsigned long start_address,
+                                unsigned int page_size,
+                                unsigned long next_src);
 void erase_some_sectors(unsigned long end_addr, unsigned char progress);
 void erase_sector(unsigned long address_in_sector);
-void enable_quad_mode(void);
+void erase_sector_bits(unsigned long address_in_sector,
+                       unsigned char size_bits);
+unsigned char quad_mode_ok(void);
+unsigned char enable_quad_mode(void);
 char *get_model_name(uint8_t model_id);
 
 void spi_clock_low(void);
@@ -138,6 +171,7 @@ void spi_tx_byte(unsigned char b);
 unsigned char qspi_rx_byte(void);
 unsigned char spi_rx_byte(void);
 void read_sr1(void);
+void sr1_wait(unsigned char mask);
 void read_ppb_for_sector(unsigned long sector_start);
 void read_ppbl(void);
 void spi_write_enable(void);
@@ -146,10 +180,44 @@ void spi_write_disable(void);
 
 // #define DEBUG_BITBASH(x) { printf("@%d:%02x",__LINE__,x); }
 #define DEBUG_BITBASH(x)
+// #define DEBUG_SPI_CMD(c, a) { printf("<%02x %08lx>", (c)->opcode, a); }
+#define DEBUG_SPI_CMD(c, a)
+
+/*
+  Descriptor of a SPI command for spi_command
+*/
+typedef struct {
+  unsigned char opcode;
+  unsigned char addr_bytes;   // 0, 3 or 4 address bytes, MSB first
+  unsigned char dummy_clocks; // clocks between address and data
+  unsigned char tx_len;       // bytes sent from spi_cmd_data
+  unsigned char rx_len;       // bytes received into spi_cmd_data
+  unsigned char flags;
+} spi_cmd_type;
+
+// data phase on all four lanes
+#define SPI_CMD_QUAD 0x01
+// pull the clock low before releasing CS
+#define SPI_CMD_CLOCK_LOW 0x02
+// keep CS low, the caller continues the data phase
+#define SPI_CMD_OPEN 0x04
+
+#define SPI_CMD_DATA_MAX 8
+extern unsigned char spi_cmd_data[SPI_CMD_DATA_MAX];
+
+void spi_command(const spi_cmd_type *cmd, unsigned long address);
+void spi_opcode(unsigned char opcode);
+
+// returned by flash_first_nonblank if the region is erased
+#define FLASH_BLANK 0xffffffffUL
 
 #define SELECTED_FILE_INVALID 0
 #define SELECTED_FILE_ERASE 1
 #define SELECTED_FILE_VALID 2
+// copy the core in copy_source_slot
+#define SELECTED_FILE_COPY 3
+// compare the slot with the file, without writing
+#define SELECTED_FILE_VERIFY 4
 
 #define CASE_INSENSITIVE 0
 #define CASE_SENSITIVE 1